@@ -6,14 +6,22 @@
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ANFISA_BBF_X86
+#include <immintrin.h>
+#endif
+
 namespace anfisa {
 
 CascadeBBF::CascadeBBF()
 	: tsr(1.0f), tsc(1.0f), tdepth(5),
 	  ntrees(0)
 {
+	valid = false;
 }
 
 void CascadeBBF::load(const std::string &fname)
@@ -26,80 +34,495 @@ void CascadeBBF::save(const std::string &fname)
 
 bool CascadeBBF::load_binary(const std::string &path)
 {
+	valid = false;
 	FILE* file = fopen(path.c_str(), "rb");
 	if (!file)
 		return false;
 
-	fread(&tsr, sizeof(float), 1, file);
-	fread(&tsc, sizeof(float), 1, file);
-	fread(&tdepth, sizeof(int), 1, file);
-
-	fread(&ntrees, sizeof(int), 1, file);
+	bool ok = fread(&tsr, sizeof(float), 1, file) == 1 &&
+		fread(&tsc, sizeof(float), 1, file) == 1 &&
+		fread(&tdepth, sizeof(int), 1, file) == 1 &&
+		fread(&ntrees, sizeof(int), 1, file) == 1;
+	if (!ok || tdepth < 1 || tdepth > 16 || ntrees < 1)
+	{
+		fclose(file);
+		aifil::log_warning("wrong BBF cascade file: %s", path.c_str());
+		return false;
+	}
 
-	for (int i = 0; i < ntrees; ++i)
+	//the header is untrusted: the trees must fit in the rest of the file
+	//before anything is allocated
+	const int nodes = tree_size();
+	const size_t tree_bytes = sizeof(int32_t) * (nodes - 1) + sizeof(float) * (nodes + 1);
+	const long header_end = ftell(file);
+	const bool sized = header_end >= 0 && !fseek(file, 0, SEEK_END);
+	const long file_end = sized ? ftell(file) : -1;
+	if (file_end < header_end || fseek(file, header_end, SEEK_SET) ||
+		(size_t)ntrees > size_t(file_end - header_end) / tree_bytes)
 	{
-		fread(&tcodes[i][0], sizeof(int32_t), (1<<tdepth)-1, file);
-		fread(&luts[i][0], sizeof(float), 1<<tdepth, file);
-		fread(&thresholds[i], sizeof(float), 1, file);
+		fclose(file);
+		aifil::log_warning("wrong BBF cascade file: %s", path.c_str());
+		ntrees = 0;
+		return false;
 	}
 
+	tcodes.assign((size_t)ntrees * nodes, 0);
+	luts.resize((size_t)ntrees * nodes);
+	thresholds.resize(ntrees);
+
+	for (int i = 0; i < ntrees && ok; ++i)
+	{
+		ok = fread(&tcodes[i * nodes + 1], sizeof(int32_t), nodes - 1, file) == size_t(nodes - 1) &&
+			fread(&luts[i * nodes], sizeof(float), nodes, file) == size_t(nodes) &&
+			fread(&thresholds[i], sizeof(float), 1, file) == 1;
+	}
 	fclose(file);
+
+	if (!ok)
+	{
+		aifil::log_warning("wrong BBF cascade file: %s", path.c_str());
+		ntrees = 0;
+		tcodes.clear();
+		luts.clear();
+		thresholds.clear();
+		return false;
+	}
+
+	valid = true;
 	return true;
 }
 
-int CascadeBBF::save_binary(const std::string &path)
+bool CascadeBBF::save_binary(const std::string &path) const
 {
 	FILE* file = fopen(path.c_str(), "wb");
 	if (!file)
-		return 0;
+		return false;
 
 	fwrite(&tsr, sizeof(float), 1, file);
 	fwrite(&tsc, sizeof(float), 1, file);
 	fwrite(&tdepth, sizeof(int), 1, file);
 
 	fwrite(&ntrees, sizeof(int), 1, file);
+	const int nodes = tree_size();
 	for (int i = 0; i < ntrees; ++i)
 	{
-		fwrite(&tcodes[i][0], sizeof(int32_t), (1<<tdepth)-1, file);
-		fwrite(&luts[i][0], sizeof(float), 1<<tdepth, file);
+		fwrite(&tcodes[i * nodes + 1], sizeof(int32_t), nodes - 1, file);
+		fwrite(&luts[i * nodes], sizeof(float), nodes, file);
 		fwrite(&thresholds[i], sizeof(float), 1, file);
 	}
 
-	fclose(file);
-	return 1;
+	return !fclose(file);
 }
 
-/*
-ClassifierResult CascadeBBF::run(const cv::Mat &mat, int x, int y) const
+ClassifierResult CascadeBBF::run(const cv::Mat &gray, int row, int col, int size) const
 {
 	ClassifierResult res;
-	run(&res, (integr_img_val_t*)mat.data, mat.step1(), sensitivity);
+	run(&res, gray.ptr<uint8_t>(0), gray.rows, gray.cols, (int)gray.step1(), row, col, size);
 	return res;
 }
 
-void CascadeICF::run(ClassifierResult *res, classifier_input_t *image_ptr, int rs, float sens) const
+void CascadeBBF::run(ClassifierResult *res, const uint8_t *pixels, int rows, int cols, int ldim,
+	int row, int col, int size) const
+{
+	const int r = row * 256;
+	const int c = col * 256;
+	const int s = size;
+	if ((r + 128 * s) / 256 >= rows || (r - 128 * s) / 256 < 0 ||
+		(c + 128 * s) / 256 >= cols || (c - 128 * s) / 256 < 0)
+	{
+		res->fail = true;
+		res->stop_stage = 0;
+		return;
+	}
+
+	const int nodes = tree_size();
+	float o = 0;
+	for (int i = 0; i < ntrees; ++i)
+	{
+		const int8_t *codes = (const int8_t *)&tcodes[i * nodes];
+		int idx = 1;
+		for (int j = 0; j < tdepth; ++j)
+		{
+			const int8_t *code = codes + 4 * idx;
+			idx = 2 * idx + (pixels[(r + code[0] * s) / 256 * ldim + (c + code[1] * s) / 256] <=
+				pixels[(r + code[2] * s) / 256 * ldim + (c + code[3] * s) / 256]);
+		}
+
+		o += luts[i * nodes + idx - nodes];
+		if (o <= thresholds[i])
+		{
+			res->score = o;
+			res->fail = true;
+			res->stop_stage = i;
+			return;
+		}
+	}
+
+	res->score = o - thresholds[ntrees - 1];
+	res->fail = false;
+	res->stop_stage = ntrees;
+}
+
+typedef void (*bbf_batch_fn_t)(const CascadeBBF &c, ClassifierResult *output,
+	const uint8_t *pixels, int rows, int cols, int ldim, const CandidateBBF *windows, int count);
+
+static void bbf_batch_scalar(const CascadeBBF &c, ClassifierResult *output,
+	const uint8_t *pixels, int rows, int cols, int ldim, const CandidateBBF *windows, int count)
+{
+	for (int i = 0; i < count; ++i)
+		c.run(output + i, pixels, rows, cols, ldim, windows[i].row, windows[i].col, windows[i].size);
+}
+
+#ifdef ANFISA_BBF_X86
+
+//pixels at byte offsets; 4-byte reads are aligned so they never cross
+//the page of the last pixel
+__attribute__((target("avx2")))
+static inline __m256i bbf_pixels_avx2(const int32_t *base, __m256i off, __m256i mask)
+{
+	__m256i word = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *)base,
+		_mm256_srli_epi32(off, 2), mask, 4);
+	__m256i shift = _mm256_slli_epi32(_mm256_and_si256(off, _mm256_set1_epi32(3)), 3);
+	return _mm256_and_si256(_mm256_srlv_epi32(word, shift), _mm256_set1_epi32(0xFF));
+}
+
+//(pos + code * size) / 256; the window check leaves only (-256, 0) below zero,
+//which the division truncates to 0
+__attribute__((target("avx2")))
+static inline __m256i bbf_coord_avx2(__m256i pos, __m256i code, __m256i size)
+{
+	return _mm256_srai_epi32(_mm256_max_epi32(
+		_mm256_add_epi32(pos, _mm256_mullo_epi32(code, size)), _mm256_setzero_si256()), 8);
+}
+
+__attribute__((target("avx2")))
+static void bbf_batch_avx2(const CascadeBBF &c, ClassifierResult *output,
+	const uint8_t *pixels, int rows, int cols, int ldim, const CandidateBBF *windows, int count)
+{
+	const int nodes = c.tree_size();
+	const int ntrees = c.ntrees;
+	const int32_t *base = (const int32_t *)((uintptr_t)pixels & ~uintptr_t(3));
+	const int delta = int(pixels - (const uint8_t *)base);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i vldim = _mm256_set1_epi32(ldim);
+	const __m256i vdelta = _mm256_set1_epi32(delta);
+
+	for (int i = 0; i < count; i += 8)
+	{
+		const int n = std::min(8, count - i);
+		ClassifierResult *res = output + i;
+
+		int r[8], col[8], s[8], stop[8];
+		int active = 0;
+		for (int k = 0; k < 8; ++k)
+		{
+			r[k] = col[k] = s[k] = 0;
+			stop[k] = ntrees;
+			if (k >= n)
+				continue;
+			const CandidateBBF &w = windows[i + k];
+			const int wr = w.row * 256;
+			const int wc = w.col * 256;
+			if ((wr + 128 * w.size) / 256 >= rows || (wr - 128 * w.size) / 256 < 0 ||
+				(wc + 128 * w.size) / 256 >= cols || (wc - 128 * w.size) / 256 < 0)
+			{
+				res[k].fail = true;
+				res[k].stop_stage = 0;
+				continue;
+			}
+			r[k] = wr;
+			col[k] = wc;
+			s[k] = w.size;
+			active |= 1 << k;
+		}
+		if (!active)
+			continue;
+		const int inside = active;
+
+		const __m256i vr = _mm256_loadu_si256((const __m256i *)r);
+		const __m256i vc = _mm256_loadu_si256((const __m256i *)col);
+		const __m256i vs = _mm256_loadu_si256((const __m256i *)s);
+		const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+		__m256 o = _mm256_setzero_ps();
+		int failed = 0;
+
+		for (int t = 0; t < ntrees && active; ++t)
+		{
+			const __m256i mask = _mm256_cmpgt_epi32(
+				_mm256_and_si256(_mm256_set1_epi32(active), lane_bits), _mm256_setzero_si256());
+			const int32_t *codes = &c.tcodes[t * nodes];
+			__m256i idx = one;
+			for (int j = 0; j < c.tdepth; ++j)
+			{
+				__m256i code = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+					(const int *)codes, idx, mask, 4);
+				__m256i r1 = _mm256_srai_epi32(_mm256_slli_epi32(code, 24), 24);
+				__m256i c1 = _mm256_srai_epi32(_mm256_slli_epi32(code, 16), 24);
+				__m256i r2 = _mm256_srai_epi32(_mm256_slli_epi32(code, 8), 24);
+				__m256i c2 = _mm256_srai_epi32(code, 24);
+
+				__m256i off1 = _mm256_add_epi32(
+					_mm256_mullo_epi32(bbf_coord_avx2(vr, r1, vs), vldim),
+					_mm256_add_epi32(bbf_coord_avx2(vc, c1, vs), vdelta));
+				__m256i off2 = _mm256_add_epi32(
+					_mm256_mullo_epi32(bbf_coord_avx2(vr, r2, vs), vldim),
+					_mm256_add_epi32(bbf_coord_avx2(vc, c2, vs), vdelta));
+
+				__m256i p1 = bbf_pixels_avx2(base, off1, mask);
+				__m256i p2 = bbf_pixels_avx2(base, off2, mask);
+				//2 * idx + (p1 <= p2)
+				idx = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(idx, idx), one),
+					_mm256_cmpgt_epi32(p1, p2));
+			}
+
+			//leaf idx is in [nodes, 2 * nodes), lut index t * nodes + idx - nodes
+			__m256 lut = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), c.luts.data() + t * nodes,
+				_mm256_sub_epi32(idx, _mm256_set1_epi32(nodes)), _mm256_castsi256_ps(mask), 4);
+			o = _mm256_add_ps(o, lut);
+
+			int rej = _mm256_movemask_ps(
+				_mm256_cmp_ps(o, _mm256_set1_ps(c.thresholds[t]), _CMP_LE_OQ)) & active;
+			for (int k = 0; k < 8; ++k)
+				if (rej & (1 << k))
+					stop[k] = t;
+			failed |= rej;
+			active &= ~rej;
+		}
+
+		float score[8];
+		_mm256_storeu_ps(score, o);
+		for (int k = 0; k < n; ++k)
+		{
+			if (!(inside & (1 << k)))
+				continue;
+			if (failed & (1 << k))
+			{
+				res[k].score = score[k];
+				res[k].fail = true;
+			}
+			else
+			{
+				res[k].score = score[k] - c.thresholds[ntrees - 1];
+				res[k].fail = false;
+			}
+			res[k].stop_stage = stop[k];
+		}
+	}
+}
+
+#endif  // ANFISA_BBF_X86
+
+static bbf_batch_fn_t bbf_batch_select()
+{
+#ifdef ANFISA_BBF_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return bbf_batch_avx2;
+#endif
+	return bbf_batch_scalar;
+}
+
+void CascadeBBF::run_batch(ClassifierResult *output, const uint8_t *pixels, int rows, int cols,
+	int ldim, const CandidateBBF *windows, int count) const
+{
+	static const bbf_batch_fn_t batch_fn = bbf_batch_select();
+	batch_fn(*this, output, pixels, rows, cols, ldim, windows, count);
+}
+
+//cos and sin of k / 32 turns, scaled by 256
+static const int bbf_qcos[32] = {
+	256, 251, 236, 212, 181, 142, 97, 49, 0, -49, -97, -142, -181, -212, -236, -251,
+	-256, -251, -236, -212, -181, -142, -97, -49, 0, 49, 97, 142, 181, 212, 236, 251};
+static const int bbf_qsin[32] = {
+	0, 49, 97, 142, 181, 212, 236, 251, 256, 251, 236, 212, 181, 142, 97, 49,
+	0, -49, -97, -142, -181, -212, -236, -251, -256, -251, -236, -212, -181, -142, -97, -49};
+
+void CascadeBBF::run_rotated(ClassifierResult *res, const uint8_t *pixels, int rows, int cols,
+	int ldim, int row, int col, int size, float angle) const
 {
-	int q = 0;
-	int cnt = (int)weak_classifiers.size();
-	for ( ; q < cnt; ++q)
+	angle -= floorf(angle);
+	const int a = int(32 * angle) & 31;
+	const int qcos = size * bbf_qcos[a];
+	const int qsin = size * bbf_qsin[a];
+	const int r = row * 65536;
+	const int c = col * 65536;
+
+	const int nodes = tree_size();
+	float o = 0;
+	for (int i = 0; i < ntrees; ++i)
 	{
-		res->score += weak_classifiers[q].run(image_ptr, rs, channels);
-		float rej = weak_classifiers[q].reject_threshold - sens * q / cnt;
-		if (soft_cascade && res->score < rej)
+		const int8_t *codes = (const int8_t *)&tcodes[i * nodes];
+		int idx = 1;
+		for (int j = 0; j < tdepth; ++j)
 		{
+			const int8_t *code = codes + 4 * idx;
+			int r1 = (r + qcos * code[0] - qsin * code[1]) / 65536;
+			int c1 = (c + qsin * code[0] + qcos * code[1]) / 65536;
+			int r2 = (r + qcos * code[2] - qsin * code[3]) / 65536;
+			int c2 = (c + qsin * code[2] + qcos * code[3]) / 65536;
+			r1 = std::min(std::max(r1, 0), rows - 1);
+			c1 = std::min(std::max(c1, 0), cols - 1);
+			r2 = std::min(std::max(r2, 0), rows - 1);
+			c2 = std::min(std::max(c2, 0), cols - 1);
+			idx = 2 * idx + (pixels[r1 * ldim + c1] <= pixels[r2 * ldim + c2]);
+		}
+
+		o += luts[i * nodes + idx - nodes];
+		if (o <= thresholds[i])
+		{
+			res->score = o;
 			res->fail = true;
-			break;
+			res->stop_stage = i;
+			return;
 		}
-		if (soft_cascade && res->score > weak_classifiers[q].approve_threshold)
+	}
+
+	res->score = o - thresholds[ntrees - 1];
+	res->fail = false;
+	res->stop_stage = ntrees;
+}
+
+//arguments of CascadeBBF::detect() shared by its band tasks
+struct ScanBBF
+{
+	const CascadeBBF *cascade;
+	const cv::Mat *gray;
+	const ScanParamsBBF *params;
+	ScanContextBBF *ctx;
+};
+
+static void bbf_scan_band(const CascadeBBF &c, const cv::Mat &gray, const ScanParamsBBF &params,
+	const BandBBF &band, std::vector<CandidateBBF> &candidates,
+	std::vector<ClassifierResult> &results, std::vector<DetectionRaw> &detections)
+{
+	const int size = band.size;
+	const int step = band.step;
+	const int scale_n = band.scale_n;
+	const int half = size / 2;
+	candidates.clear();
+	for (int r = band.row; r < band.row_end; r += step)
+	{
+		for (int col = half + 1; col <= gray.cols - half - 1; col += step)
 		{
-			res->fail = false;
-			break;
+			CandidateBBF w = {r, col, size};
+			candidates.push_back(w);
 		}
-		if (q >= 10 && q < 74)
-			res->bits_desc = (1ULL << (q - 10));
 	}
-	res->stop_stage = q;
+	if (candidates.empty())
+		return;
+	results.resize(candidates.size());
+
+	const uint8_t *pixels = gray.ptr<uint8_t>(0);
+	const int ldim = (int)gray.step1();
+	const int angles = params.angles.empty() ? 1 : (int)params.angles.size();
+	const int box_w = int(size * c.tsc);
+	const int box_h = int(size * c.tsr);
+	for (int a = 0; a < angles; ++a)
+	{
+		const float angle = params.angles.empty() ? 0.0f : params.angles[a];
+		if (angle == 0.0f)
+			c.run_batch(&results[0], pixels, gray.rows, gray.cols, ldim,
+				&candidates[0], (int)candidates.size());
+		else
+			for (size_t i = 0; i < candidates.size(); ++i)
+				c.run_rotated(&results[i], pixels, gray.rows, gray.cols, ldim,
+					candidates[i].row, candidates[i].col, size, angle);
+
+		for (size_t i = 0; i < candidates.size(); ++i)
+		{
+			if (results[i].fail)
+				continue;
+			DetectionRaw d;
+			d.x = candidates[i].col - box_w / 2;
+			d.y = candidates[i].row - box_h / 2;
+			d.width = box_w;
+			d.height = box_h;
+			d.confidence = results[i].score;
+			d.scale_n = scale_n * angles + a;
+			d.fingerprint = 0;
+			detections.push_back(d);
+		}
+	}
+}
+
+//a pointer and an index: trivially copyable and small enough for
+//std::function to keep it without a heap allocation per band
+struct BandTaskBBF
+{
+	const ScanBBF *scan;
+	int band;
+
+	void operator()(int t) const
+	{
+		ScanContextBBF &ctx = *scan->ctx;
+		bbf_scan_band(*scan->cascade, *scan->gray, *scan->params, ctx.bands[band],
+			ctx.candidates[t], ctx.results[t], ctx.detections[t]);
+	}
+};
+
+void CascadeBBF::detect(const cv::Mat &image, std::vector<DetectionRaw> &detections,
+	const ScanParamsBBF &params, ScanContextBBF &ctx, TaskPool *pool) const
+{
+	detections.clear();
+	if (!valid || image.empty())
+		return;
+	if (image.depth() != CV_8U ||
+		(image.channels() != 1 && image.channels() != 3 && image.channels() != 4))
+	{
+		aifil::log_warning("BBF scan: 8-bit gray, BGR or BGRA image expected");
+		return;
+	}
+
+	const cv::Mat *gray = &image;
+	if (image.channels() != 1)
+	{
+		cv::cvtColor(image, ctx.gray,
+			image.channels() == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);
+		gray = &ctx.gray;
+	}
+
+	const int threads = pool ? pool->size() : 1;
+	ctx.candidates.resize(threads);
+	ctx.results.resize(threads);
+	ctx.detections.resize(threads);
+	for (int t = 0; t < threads; ++t)
+		ctx.detections[t].clear();
+
+	const int max_size = params.max_size > 0 ? params.max_size :
+		std::min(gray->rows, gray->cols);
+	const int band_rows = std::max(params.band_rows, 1);
+	ctx.bands.clear();
+	int scale_n = 0;
+	for (int size = std::max(params.min_size, 1); size <= max_size;
+		size = std::max(size + 1, int(size * params.scale_factor)), ++scale_n)
+	{
+		const int half = size / 2;
+		const int step = std::max(int(params.stride * size), 1);
+		const int row_end = gray->rows - half;
+		for (int row = half + 1; row < row_end; row += band_rows * step)
+		{
+			BandBBF band = {size, step, row, std::min(row + band_rows * step, row_end), scale_n};
+			ctx.bands.push_back(band);
+		}
+	}
+
+	//tasks are pushed after the band list is complete, it is not resized under them
+	const ScanBBF scan = {this, gray, &params, &ctx};
+	for (int b = 0; b < (int)ctx.bands.size(); ++b)
+	{
+		BandTaskBBF task = {&scan, b};
+		if (pool)
+			pool->push(task);
+		else
+			task(0);
+	}
+	if (pool)
+		pool->wait();
+
+	for (int t = 0; t < threads; ++t)
+		detections.insert(detections.end(), ctx.detections[t].begin(), ctx.detections[t].end());
+	if (params.merge)
+		ctx.grouping.group(detections, params.grouping);
 }
-*/
 
 }  // namespace anfisa
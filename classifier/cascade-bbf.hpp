@@ -4,7 +4,9 @@
 #include "decision-tree.hpp"
 #include "classifier.hpp"
 
+#include "core/grouping.hpp"
 #include "core/raw-structures.hpp"
+#include "core/task-pool.hpp"
 #include "feature/icf.hpp"
 
 #include <opencv2/core/core.hpp>
@@ -15,27 +17,103 @@
 
 namespace anfisa {
 
+//window of the BBF scan: center and size in pixels
+struct CandidateBBF
+{
+	int row;
+	int col;
+	int size;
+};
+
+struct ScanParamsBBF
+{
+	ScanParamsBBF()
+		: min_size(24), max_size(0), scale_factor(1.2f), stride(0.1f),
+		  band_rows(16), merge(true) {}
+
+	//window sizes (pixels), max_size 0 - up to the image size
+	int min_size;
+	int max_size;
+	float scale_factor;
+	//window step relative to window size
+	float stride;
+	//in-plane rotations to test (turns, 0.125 = 45 degrees), empty - upright only
+	std::vector<float> angles;
+	//window rows per parallel task
+	int band_rows;
+	//group overlapping hits with DetectionGrouping::group()
+	bool merge;
+	GroupingParams grouping;
+};
+
+//rows of windows of one size scanned by one task
+struct BandBBF
+{
+	int size;
+	int step;
+	int row;
+	int row_end;
+	int scale_n;
+};
+
+// Per-stream buffers of the BBF scan, reused while frames keep coming.
+struct ScanContextBBF
+{
+	cv::Mat gray;
+	//bands of the current frame, tasks refer to them by index
+	std::vector<BandBBF> bands;
+	//per thread buffers
+	std::vector<std::vector<CandidateBBF> > candidates;
+	std::vector<std::vector<ClassifierResult> > results;
+	std::vector<std::vector<DetectionRaw> > detections;
+	DetectionGrouping grouping;
+};
+
+// Cascade of binary decision trees over pixel intensity comparisons
+// (pico model). Window is given by its center (row, col) and size in pixels,
+// tree node codes are offsets in units of size / 256.
 struct CascadeBBF : Classifier
 {
 	CascadeBBF();
 	void load(const std::string &name);
 	void save(const std::string &name);
-	void load_binary(const std::string &name);
-	void save_binary(const std::string &name);
+	bool load_binary(const std::string &name);
+	bool save_binary(const std::string &name) const;
+
+	//gray: CV_8UC1 image
+	ClassifierResult run(const cv::Mat &gray, int row, int col, int size) const;
+	void run(ClassifierResult *output, const uint8_t *pixels, int rows, int cols, int ldim,
+		int row, int col, int size) const;
+	//score count windows at once; AVX2 gathers with branch-free tree
+	//traversal and per-lane early exit, same results as run()
+	void run_batch(ClassifierResult *output, const uint8_t *pixels, int rows, int cols, int ldim,
+		const CandidateBBF *windows, int count) const;
+
+	//window rotated by angle (turns), pico fixed point: node coordinates
+	//are clamped to the image instead of checking window bounds
+	void run_rotated(ClassifierResult *output, const uint8_t *pixels, int rows, int cols, int ldim,
+		int row, int col, int size, float angle) const;
+
+	//scan all window sizes and rotations over the image (8-bit gray, BGR
+	//or BGRA, nothing is found in other images);
+	//hits are boxes of size * tsc x size * tsr around the window center,
+	//DetectionRaw::scale_n is size index * angles count + angle index
+	void detect(const cv::Mat &image, std::vector<DetectionRaw> &detections,
+		const ScanParamsBBF &params, ScanContextBBF &ctx, TaskPool *pool = 0) const;
 
-	/*
-	ClassifierResult run(const cv::Mat &mat, int x, int y) const;
-	void run(ClassifierResult *output, classifier_input_t *image_ptr, int rs, float sens) const;
-	*/
+	//nodes per tree
+	int tree_size() const { return 1 << tdepth; }
 
 	float tsr;
 	float tsc;
 	int tdepth;
 	int ntrees;
 
-	int32_t tcodes[4096][1024];
-	float luts[4096][1024];
-	float thresholds[4096];
+	//ntrees * tree_size() each; node codes of a tree start at index 1,
+	//every code is 4 signed bytes: r1 c1 r2 c2
+	std::vector<int32_t> tcodes;
+	std::vector<float> luts;
+	std::vector<float> thresholds;
 };
 
 } //namespace anfisa
@@ -1,12 +1,21 @@
 #include "cascade-icf.hpp"
 
+#include "core/mapped-file.hpp"
+
 #include <logging.hpp>
 
 #include <opencv2/opencv.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
 
+#include <atomic>
 #include <cstdio>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ANFISA_ICF_X86
+#include <immintrin.h>
+#endif
 
 namespace anfisa {
 
@@ -20,8 +29,16 @@ bool cascade_icf_ascent(const CascadeICF &i, const CascadeICF &j)
 		return false;
 }
 
+struct CascadeICFIndexAscent
+{
+	CascadeICFIndexAscent(const std::vector<CascadeICF> &m) : models(m) {}
+	bool operator()(int i, int j) const { return cascade_icf_ascent(models[i], models[j]); }
+	const std::vector<CascadeICF> &models;
+};
+
 CascadeICF::CascadeICF()
 {
+	valid = false;
 	resizable = true;
 	soft_cascade = true;
 	sensitivity = 0;
@@ -184,7 +201,7 @@ void CascadeICF::create_scaled(float scale)
 	win.tile_w = int(win.tile_w * scale);
 	win.tile_h = int(win.tile_h * scale);
 	win.obj_w = int(win.obj_w * scale);
-	win.obj_w = int(win.obj_w * scale);
+	win.obj_h = int(win.obj_h * scale);
 	win.margin_top = int(win.margin_top * scale);
 	win.margin_right = int(win.margin_right * scale);
 	win.margin_bottom = int(win.margin_bottom * scale);
@@ -199,8 +216,681 @@ void CascadeICF::create_scaled(float scale)
 	}
 }
 
+CascadeICFCompiled::CascadeICFCompiled()
+	: channels(0), soft_cascade(true), sensitivity(0), rs(0),
+	  stages_count(0), features_count(0), rects_count(0),
+	  stage_weights(0), stage_reject(0), stage_approve(0), stage_features(0),
+	  feature_rects(0), feature_min_val(0),
+	  rect_alpha(0), rect_channel(0), rect_points(0)
+{
+	valid = false;
+}
+
+static bool dtree_icf_has_feature(const DTreeICF &wc, int k)
+{
+	if (k == 1)
+		return !!(wc.pass & 0x2);
+	if (k == 2)
+		return !!(wc.pass & 0x1);
+	return true;
+}
+
+bool CascadeICFCompiled::compile(const CascadeICF &cascade, int row_stride)
+{
+	valid = false;
+	if (!cascade.valid)
+		return false;
+
+	static_cast<Classifier &>(*this) = cascade;
+	channels = cascade.channels;
+	soft_cascade = cascade.soft_cascade;
+	sensitivity = cascade.sensitivity;
+
+	stages_count = (int)cascade.weak_classifiers.size();
+	features_count = 0;
+	rects_count = 0;
+	for (int q = 0; q < stages_count; ++q)
+	{
+		const DTreeICF &wc = cascade.weak_classifiers[q];
+		for (int k = 0; k < 3; ++k)
+		{
+			if (!dtree_icf_has_feature(wc, k))
+				continue;
+			++features_count;
+			rects_count += wc.features[k].count;
+		}
+	}
+
+	storage.reset(new char[(size_t)storage_words() * 4], std::default_delete<char[]>());
+	layout(storage.get());
+
+	float *weights = const_cast<float *>(stage_weights);
+	float *reject = const_cast<float *>(stage_reject);
+	float *approve = const_cast<float *>(stage_approve);
+	int32_t *stage_feat = const_cast<int32_t *>(stage_features);
+	int32_t *feat_rects = const_cast<int32_t *>(feature_rects);
+	float *min_val = const_cast<float *>(feature_min_val);
+	float *alpha = const_cast<float *>(rect_alpha);
+	int32_t *channel = const_cast<int32_t *>(rect_channel);
+	int32_t *points = const_cast<int32_t *>(rect_points);
+
+	int f = 0;
+	int r = 0;
+	for (int q = 0; q < stages_count; ++q)
+	{
+		const DTreeICF &wc = cascade.weak_classifiers[q];
+		weights[2 * q] = wc.weight[0];
+		weights[2 * q + 1] = wc.weight[1];
+		reject[q] = wc.reject_threshold;
+		approve[q] = wc.approve_threshold;
+		for (int k = 0; k < 3; ++k)
+		{
+			if (!dtree_icf_has_feature(wc, k))
+			{
+				stage_feat[3 * q + k] = -1;
+				continue;
+			}
+
+			const FeatureVectorICF &fv = wc.features[k];
+			stage_feat[3 * q + k] = f;
+			feat_rects[f] = r;
+			min_val[f] = fv.min_val;
+			for (int i = 0; i < fv.count; ++i, ++r)
+			{
+				alpha[r] = fv.alpha[i];
+				channel[r] = fv.channel[i];
+				points[4 * r] = fv.points[2 * i].x;
+				points[4 * r + 1] = fv.points[2 * i].y;
+				points[4 * r + 2] = fv.points[2 * i + 1].x;
+				points[4 * r + 3] = fv.points[2 * i + 1].y;
+			}
+			++f;
+		}
+	}
+	feat_rects[f] = r;
+
+	bind(row_stride);
+	valid = true;
+	return true;
+}
+
+uint64_t CascadeICFCompiled::storage_words() const
+{
+	//all arrays are 4-byte words; 64-bit so that header counts cannot overflow
+	return 7 * (uint64_t)stages_count + 2 * (uint64_t)features_count + 1 +
+		6 * (uint64_t)rects_count;
+}
+
+void CascadeICFCompiled::layout(const char *base)
+{
+	const float *fp = reinterpret_cast<const float *>(base);
+	stage_weights = fp;
+	stage_reject = stage_weights + 2 * stages_count;
+	stage_approve = stage_reject + stages_count;
+	stage_features = reinterpret_cast<const int32_t *>(stage_approve + stages_count);
+	feature_rects = stage_features + 3 * stages_count;
+	feature_min_val = reinterpret_cast<const float *>(feature_rects + features_count + 1);
+	rect_alpha = feature_min_val + features_count;
+	rect_channel = reinterpret_cast<const int32_t *>(rect_alpha + rects_count);
+	rect_points = rect_channel + rects_count;
+}
+
+void CascadeICFCompiled::bind(int row_stride)
+{
+	rs = row_stride;
+	rect_offsets.resize(4 * rects_count);
+	for (int r = 0; r < rects_count; ++r)
+	{
+		const int32_t *pt = rect_points + 4 * r;
+		int x1 = pt[0] * channels + rect_channel[r];
+		int x2 = pt[2] * channels + rect_channel[r];
+		int y1 = pt[1] * rs;
+		int y2 = pt[3] * rs;
+		rect_offsets[4 * r] = y1 + x1;
+		rect_offsets[4 * r + 1] = y1 + x2;
+		rect_offsets[4 * r + 2] = y2 + x1;
+		rect_offsets[4 * r + 3] = y2 + x2;
+	}
+}
+
+bool CascadeICFCompiled::decompile(CascadeICF &cascade) const
+{
+	if (!valid)
+		return false;
+
+	static_cast<Classifier &>(cascade) = *this;
+	cascade.channels = channels;
+	cascade.soft_cascade = soft_cascade;
+	cascade.sensitivity = sensitivity;
+	cascade.weak_classifiers.resize(stages_count);
+	for (int q = 0; q < stages_count; ++q)
+	{
+		DTreeICF &wc = cascade.weak_classifiers[q];
+		wc.weight[0] = stage_weights[2 * q];
+		wc.weight[1] = stage_weights[2 * q + 1];
+		wc.reject_threshold = stage_reject[q];
+		wc.approve_threshold = stage_approve[q];
+		wc.pass = (stage_features[3 * q + 1] >= 0 ? 0x2 : 0) |
+			(stage_features[3 * q + 2] >= 0 ? 0x1 : 0);
+		for (int k = 0; k < 3; ++k)
+		{
+			int f = stage_features[3 * q + k];
+			if (f < 0)
+				continue;
+
+			FeatureVectorICF &fv = wc.features[k];
+			fv.min_val = feature_min_val[f];
+			fv.count = feature_rects[f + 1] - feature_rects[f];
+			for (int i = 0; i < fv.count; ++i)
+			{
+				int r = feature_rects[f] + i;
+				fv.alpha[i] = rect_alpha[r];
+				fv.channel[i] = rect_channel[r];
+				fv.points[2 * i] = cv::Point(rect_points[4 * r], rect_points[4 * r + 1]);
+				fv.points[2 * i + 1] = cv::Point(rect_points[4 * r + 2], rect_points[4 * r + 3]);
+			}
+		}
+	}
+	cascade.resizable = cascade.resize_coeffs.create(channels);
+	return true;
+}
+
+// .icfb header, all fields are 4-byte words in writer byte order
+struct CascadeICFFileHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t endianness;
+	uint32_t checksum;
+	uint32_t payload_words;
+
+	int32_t tile_w;
+	int32_t tile_h;
+	int32_t margin_top;
+	int32_t margin_right;
+	int32_t margin_bottom;
+	int32_t margin_left;
+	int32_t channels;
+	int32_t soft_cascade;
+	float sensitivity;
+
+	int32_t stages_count;
+	int32_t features_count;
+	int32_t rects_count;
+};
+
+static const char CASCADE_ICF_MAGIC[4] = {'A', 'I', 'C', 'F'};
+static const uint32_t CASCADE_ICF_VERSION = 1;
+static const uint32_t CASCADE_ICF_ENDIANNESS = 0x01020304;
+
+bool CascadeICFCompiled::save(const std::string &fname) const
+{
+	if (!valid || storage_words() > UINT32_MAX)
+		return false;
+
+	CascadeICFFileHeader header;
+	memcpy(header.magic, CASCADE_ICF_MAGIC, 4);
+	header.version = CASCADE_ICF_VERSION;
+	header.endianness = CASCADE_ICF_ENDIANNESS;
+	header.payload_words = (uint32_t)storage_words();
+	header.checksum = checksum_words(storage.get(), header.payload_words);
+	header.tile_w = win.tile_w;
+	header.tile_h = win.tile_h;
+	header.margin_top = win.margin_top;
+	header.margin_right = win.margin_right;
+	header.margin_bottom = win.margin_bottom;
+	header.margin_left = win.margin_left;
+	header.channels = channels;
+	header.soft_cascade = soft_cascade;
+	header.sensitivity = sensitivity;
+	header.stages_count = stages_count;
+	header.features_count = features_count;
+	header.rects_count = rects_count;
+
+	FILE *file = fopen(fname.c_str(), "wb");
+	if (!file)
+		return false;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(storage.get(), 4, header.payload_words, file) == header.payload_words;
+	ok = !fclose(file) && ok;
+	return ok;
+}
+
+bool CascadeICFCompiled::check() const
+{
+	if (channels < 1 || win.tile_w <= 0 || win.tile_h <= 0 || win.obj_w <= 0 || win.obj_h <= 0 ||
+		win.margin_left < 0 || win.margin_top < 0 || win.margin_right < 0 || win.margin_bottom < 0)
+		return false;
+
+	for (int q = 0; q < stages_count; ++q)
+	{
+		const int32_t *f = stage_features + 3 * q;
+		if (f[0] < 0 || f[0] >= features_count)
+			return false;
+		for (int k = 1; k < 3; ++k)
+			if (f[k] < -1 || f[k] >= features_count)
+				return false;
+	}
+
+	//decompile() fills FeatureVectorICF arrays
+	const FeatureVectorICF fv = FeatureVectorICF();
+	const int max_rects = int(sizeof(fv.alpha) / sizeof(fv.alpha[0]));
+	if (feature_rects[0] != 0 || feature_rects[features_count] != rects_count)
+		return false;
+	for (int f = 0; f < features_count; ++f)
+	{
+		const int count = feature_rects[f + 1] - feature_rects[f];
+		if (count < 0 || count > max_rects)
+			return false;
+	}
+
+	for (int r = 0; r < rects_count; ++r)
+	{
+		const int32_t *pt = rect_points + 4 * r;
+		if (rect_channel[r] < 0 || rect_channel[r] >= channels ||
+			pt[0] < 0 || pt[0] > pt[2] || pt[2] > win.tile_w ||
+			pt[1] < 0 || pt[1] > pt[3] || pt[3] > win.tile_h)
+			return false;
+	}
+	return true;
+}
+
+bool CascadeICFCompiled::load(const std::string &fname)
+{
+	valid = false;
+	size_t size = 0;
+	std::shared_ptr<char> data = map_file(fname, size);
+	if (!data || size < sizeof(CascadeICFFileHeader))
+		return false;
+
+	const CascadeICFFileHeader &header = *(const CascadeICFFileHeader *)data.get();
+	if (memcmp(header.magic, CASCADE_ICF_MAGIC, 4))
+	{
+		aifil::log_warning("not a binary ICF cascade: %s", fname.c_str());
+		return false;
+	}
+	if (header.endianness != CASCADE_ICF_ENDIANNESS)
+	{
+		aifil::log_warning("binary ICF cascade has wrong byte order: %s", fname.c_str());
+		return false;
+	}
+	if (header.version != CASCADE_ICF_VERSION)
+	{
+		aifil::log_warning("unsupported binary ICF cascade version %u: %s",
+			header.version, fname.c_str());
+		return false;
+	}
+
+	stages_count = header.stages_count;
+	features_count = header.features_count;
+	rects_count = header.rects_count;
+	//every count occupies at least one payload word, bound them before summing
+	const uint64_t file_words = (size - sizeof(header)) / 4;
+	if (stages_count <= 0 || features_count < stages_count || rects_count < features_count ||
+		(uint64_t)rects_count > file_words ||
+		header.payload_words != storage_words() ||
+		size != sizeof(header) + 4 * (size_t)header.payload_words)
+	{
+		aifil::log_warning("wrong binary ICF cascade size: %s", fname.c_str());
+		return false;
+	}
+
+	const char *payload = data.get() + sizeof(header);
+	if (checksum_words(payload, header.payload_words) != header.checksum)
+	{
+		aifil::log_warning("binary ICF cascade checksum mismatch: %s", fname.c_str());
+		return false;
+	}
+
+	win.tile_w = header.tile_w;
+	win.tile_h = header.tile_h;
+	win.margin_top = header.margin_top;
+	win.margin_right = header.margin_right;
+	win.margin_bottom = header.margin_bottom;
+	win.margin_left = header.margin_left;
+	win.obj_w = win.tile_w - win.margin_left - win.margin_right;
+	win.obj_h = win.tile_h - win.margin_top - win.margin_bottom;
+	channels = header.channels;
+	soft_cascade = !!header.soft_cascade;
+	sensitivity = header.sensitivity;
+
+	//shares ownership of the mapping, points to the packed block
+	storage = std::shared_ptr<char>(data, const_cast<char *>(payload));
+	layout(storage.get());
+	if (!check())
+	{
+		aifil::log_warning("binary ICF cascade has out of range indices: %s", fname.c_str());
+		storage.reset();
+		return false;
+	}
+	bind(0);
+	valid = true;
+	return true;
+}
+
+bool convert_cascade_icf(const std::string &text_name, const std::string &binary_name)
+{
+	CascadeICF cascade;
+	cascade.load(text_name);
+	if (!cascade.valid)
+		return false;
+
+	CascadeICFCompiled compiled;
+	return compiled.compile(cascade, 0) && compiled.save(binary_name);
+}
+
+ClassifierResult CascadeICFCompiled::run(const cv::Mat &mat, int x, int y) const
+{
+	ClassifierResult res;
+	if ((int)mat.step1() != rs)
+	{
+		aifil::log_warning("compiled ICF cascade is bound to another row stride");
+		res.fail = true;
+		return res;
+	}
+	run(&res, mat.ptr<classifier_input_t>(y) + x * channels, sensitivity);
+	return res;
+}
+
+float CascadeICFCompiled::run_feature(const classifier_input_t *image_ptr, int feature) const
+{
+	//same accumulation order as FeatureVectorICF::run
+	float res = 0;
+	const int32_t *off = rect_offsets.data();
+	for (int r = feature_rects[feature]; r < feature_rects[feature + 1]; ++r)
+	{
+		const int32_t *o = off + 4 * r;
+		int val = image_ptr[o[3]] - image_ptr[o[1]] - image_ptr[o[2]] + image_ptr[o[0]];
+		res += rect_alpha[r] * val;
+	}
+	return res - feature_min_val[feature];
+}
+
+void CascadeICFCompiled::run(ClassifierResult *res, const classifier_input_t *image_ptr, float sens) const
+{
+	int q = 0;
+	int cnt = stages_count;
+	for ( ; q < cnt; ++q)
+	{
+		const int32_t *f = stage_features + 3 * q;
+		const float *w = stage_weights + 2 * q;
+		float weight;
+		if (run_feature(image_ptr, f[0]) > 0)
+			weight = f[2] < 0 ? w[1] : w[run_feature(image_ptr, f[2]) > 0];
+		else
+			weight = f[1] < 0 ? w[0] : w[run_feature(image_ptr, f[1]) > 0];
+
+		res->score += weight;
+		float rej = stage_reject[q] - sens * q / cnt;
+		if (soft_cascade && res->score < rej)
+		{
+			res->fail = true;
+			break;
+		}
+		if (soft_cascade && res->score > stage_approve[q])
+		{
+			res->fail = false;
+			break;
+		}
+		if (q >= 10 && q < 74)
+			res->bits_desc = (1ULL << (q - 10));
+	}
+	res->stop_stage = q;
+}
+
+// Batched evaluation.
+// Lanes follow exactly the same float operations as the scalar path,
+// so results are identical as long as FP contraction (FMA) is not enabled
+// for the scalar code only.
+
+typedef void (*icf_batch_fn_t)(const CascadeICFCompiled &c, ClassifierResult *output,
+	const classifier_input_t *image_ptr, int step, int count, float sens);
+
+static void icf_lane_finish(ClassifierResult *res, float score, int stop, bool stopped, bool fail)
+{
+	res->score = score;
+	if (stopped)
+		res->fail = fail;
+	//CascadeICF::run() sets bits_desc on every stage it passes through
+	int last = std::min(stop - 1, 73);
+	if (last >= 10)
+		res->bits_desc = (1ULL << (last - 10));
+	res->stop_stage = stop;
+}
+
+static void icf_batch_scalar(const CascadeICFCompiled &c, ClassifierResult *output,
+	const classifier_input_t *image_ptr, int step, int count, float sens)
+{
+	for (int i = 0; i < count; ++i)
+		c.run(output + i, image_ptr + i * step, sens);
+}
+
+#ifdef ANFISA_ICF_X86
+
+__attribute__((target("avx2")))
+static __m256 icf_feature_avx2(const CascadeICFCompiled &c,
+	const classifier_input_t *image_ptr, __m256i lanes, int feature)
+{
+	__m256 acc = _mm256_setzero_ps();
+	const int32_t *off = c.rect_offsets.data();
+	for (int r = c.feature_rects[feature]; r < c.feature_rects[feature + 1]; ++r)
+	{
+		const int32_t *o = off + 4 * r;
+		__m256i a = _mm256_i32gather_epi32(image_ptr + o[0], lanes, 4);
+		__m256i b = _mm256_i32gather_epi32(image_ptr + o[1], lanes, 4);
+		__m256i d = _mm256_i32gather_epi32(image_ptr + o[2], lanes, 4);
+		__m256i e = _mm256_i32gather_epi32(image_ptr + o[3], lanes, 4);
+		__m256i val = _mm256_add_epi32(_mm256_sub_epi32(_mm256_sub_epi32(e, b), d), a);
+		acc = _mm256_add_ps(acc,
+			_mm256_mul_ps(_mm256_set1_ps(c.rect_alpha[r]), _mm256_cvtepi32_ps(val)));
+	}
+	return _mm256_sub_ps(acc, _mm256_set1_ps(c.feature_min_val[feature]));
+}
+
+__attribute__((target("avx2")))
+static void icf_batch_avx2(const CascadeICFCompiled &c, ClassifierResult *output,
+	const classifier_input_t *image_ptr, int step, int count, float sens)
+{
+	const int cnt = c.stages_count;
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	const __m256i lanes = _mm256_mullo_epi32(
+		_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(step));
+
+	int i = 0;
+	for ( ; i + 8 <= count; i += 8)
+	{
+		const classifier_input_t *ptr = image_ptr + i * step;
+		ClassifierResult *res = output + i;
+
+		float score_buf[8];
+		int stop[8];
+		for (int k = 0; k < 8; ++k)
+		{
+			score_buf[k] = res[k].score;
+			stop[k] = cnt;
+		}
+		__m256 score = _mm256_loadu_ps(score_buf);
+		int active = 0xFF;
+		int failed = 0;
+
+		for (int q = 0; q < cnt && active; ++q)
+		{
+			const int32_t *f = c.stage_features + 3 * q;
+			const __m256 w0 = _mm256_set1_ps(c.stage_weights[2 * q]);
+			const __m256 w1 = _mm256_set1_ps(c.stage_weights[2 * q + 1]);
+
+			__m256 pos = _mm256_cmp_ps(icf_feature_avx2(c, ptr, lanes, f[0]), zero, _CMP_GT_OQ);
+			int pos_bits = _mm256_movemask_ps(pos) & active;
+			__m256 wpos = w1;
+			__m256 wneg = w0;
+			if (f[2] >= 0 && pos_bits)
+				wpos = _mm256_blendv_ps(w0, w1, _mm256_cmp_ps(
+					icf_feature_avx2(c, ptr, lanes, f[2]), zero, _CMP_GT_OQ));
+			if (f[1] >= 0 && (~pos_bits & active))
+				wneg = _mm256_blendv_ps(w0, w1, _mm256_cmp_ps(
+					icf_feature_avx2(c, ptr, lanes, f[1]), zero, _CMP_GT_OQ));
+
+			__m256 act = _mm256_castsi256_ps(_mm256_cmpgt_epi32(
+				_mm256_and_si256(_mm256_set1_epi32(active), lane_bits), _mm256_setzero_si256()));
+			score = _mm256_blendv_ps(score,
+				_mm256_add_ps(score, _mm256_blendv_ps(wneg, wpos, pos)), act);
+
+			if (!c.soft_cascade)
+				continue;
+
+			float rej = c.stage_reject[q] - sens * q / cnt;
+			int rej_bits = _mm256_movemask_ps(
+				_mm256_cmp_ps(score, _mm256_set1_ps(rej), _CMP_LT_OQ)) & active;
+			int appr_bits = _mm256_movemask_ps(
+				_mm256_cmp_ps(score, _mm256_set1_ps(c.stage_approve[q]), _CMP_GT_OQ)) &
+				active & ~rej_bits;
+			int stopped = rej_bits | appr_bits;
+			for (int k = 0; k < 8; ++k)
+				if (stopped & (1 << k))
+					stop[k] = q;
+			failed |= rej_bits;
+			active &= ~stopped;
+		}
+
+		_mm256_storeu_ps(score_buf, score);
+		for (int k = 0; k < 8; ++k)
+			icf_lane_finish(res + k, score_buf[k], stop[k], stop[k] < cnt, !!(failed & (1 << k)));
+	}
+
+	icf_batch_scalar(c, output + i, image_ptr + i * step, step, count - i, sens);
+}
+
+__attribute__((target("sse2")))
+static __m128 icf_feature_sse2(const CascadeICFCompiled &c,
+	const classifier_input_t *image_ptr, int step, int feature)
+{
+	__m128 acc = _mm_setzero_ps();
+	const int32_t *off = c.rect_offsets.data();
+	for (int r = c.feature_rects[feature]; r < c.feature_rects[feature + 1]; ++r)
+	{
+		const int32_t *o = off + 4 * r;
+		__m128i pt[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			const classifier_input_t *p = image_ptr + o[k];
+			pt[k] = _mm_setr_epi32(p[0], p[step], p[2 * step], p[3 * step]);
+		}
+		__m128i val = _mm_add_epi32(_mm_sub_epi32(_mm_sub_epi32(pt[3], pt[1]), pt[2]), pt[0]);
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(c.rect_alpha[r]), _mm_cvtepi32_ps(val)));
+	}
+	return _mm_sub_ps(acc, _mm_set1_ps(c.feature_min_val[feature]));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 icf_blend_sse2(__m128 a, __m128 b, __m128 mask)
+{
+	return _mm_or_ps(_mm_andnot_ps(mask, a), _mm_and_ps(mask, b));
+}
+
+__attribute__((target("sse2")))
+static void icf_batch_sse2(const CascadeICFCompiled &c, ClassifierResult *output,
+	const classifier_input_t *image_ptr, int step, int count, float sens)
+{
+	const int cnt = c.stages_count;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+
+	int i = 0;
+	for ( ; i + 4 <= count; i += 4)
+	{
+		const classifier_input_t *ptr = image_ptr + i * step;
+		ClassifierResult *res = output + i;
+
+		float score_buf[4];
+		int stop[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			score_buf[k] = res[k].score;
+			stop[k] = cnt;
+		}
+		__m128 score = _mm_loadu_ps(score_buf);
+		int active = 0xF;
+		int failed = 0;
+
+		for (int q = 0; q < cnt && active; ++q)
+		{
+			const int32_t *f = c.stage_features + 3 * q;
+			const __m128 w0 = _mm_set1_ps(c.stage_weights[2 * q]);
+			const __m128 w1 = _mm_set1_ps(c.stage_weights[2 * q + 1]);
+
+			__m128 pos = _mm_cmpgt_ps(icf_feature_sse2(c, ptr, step, f[0]), zero);
+			int pos_bits = _mm_movemask_ps(pos) & active;
+			__m128 wpos = w1;
+			__m128 wneg = w0;
+			if (f[2] >= 0 && pos_bits)
+				wpos = icf_blend_sse2(w0, w1,
+					_mm_cmpgt_ps(icf_feature_sse2(c, ptr, step, f[2]), zero));
+			if (f[1] >= 0 && (~pos_bits & active))
+				wneg = icf_blend_sse2(w0, w1,
+					_mm_cmpgt_ps(icf_feature_sse2(c, ptr, step, f[1]), zero));
+
+			__m128 act = _mm_castsi128_ps(_mm_cmpgt_epi32(
+				_mm_and_si128(_mm_set1_epi32(active), lane_bits), _mm_setzero_si128()));
+			score = icf_blend_sse2(score,
+				_mm_add_ps(score, icf_blend_sse2(wneg, wpos, pos)), act);
+
+			if (!c.soft_cascade)
+				continue;
+
+			float rej = c.stage_reject[q] - sens * q / cnt;
+			int rej_bits = _mm_movemask_ps(_mm_cmplt_ps(score, _mm_set1_ps(rej))) & active;
+			int appr_bits = _mm_movemask_ps(
+				_mm_cmpgt_ps(score, _mm_set1_ps(c.stage_approve[q]))) & active & ~rej_bits;
+			int stopped = rej_bits | appr_bits;
+			for (int k = 0; k < 4; ++k)
+				if (stopped & (1 << k))
+					stop[k] = q;
+			failed |= rej_bits;
+			active &= ~stopped;
+		}
+
+		_mm_storeu_ps(score_buf, score);
+		for (int k = 0; k < 4; ++k)
+			icf_lane_finish(res + k, score_buf[k], stop[k], stop[k] < cnt, !!(failed & (1 << k)));
+	}
+
+	icf_batch_scalar(c, output + i, image_ptr + i * step, step, count - i, sens);
+}
+
+#endif  // ANFISA_ICF_X86
+
+static icf_batch_fn_t icf_batch_select()
+{
+#ifdef ANFISA_ICF_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return icf_batch_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return icf_batch_sse2;
+#endif
+	return icf_batch_scalar;
+}
+
+void CascadeICFCompiled::run_batch(ClassifierResult *output, const classifier_input_t *image_ptr,
+	int step, int count, float sens) const
+{
+	static const icf_batch_fn_t batch_fn = icf_batch_select();
+	batch_fn(*this, output, image_ptr, step, count, sens);
+}
+
+static std::atomic<unsigned> icf_model_generation(0);
+
+MultiscaleCascadeICF::MultiscaleCascadeICF()
+	: valid(false), generation(++icf_model_generation), min_w(0), min_h(0), max_w(0), max_h(0)
+{
+}
+
 void MultiscaleCascadeICF::load(const std::string &folder, const std::string &family_name)
 {
+	generation = ++icf_model_generation;
+
 	boost::filesystem::path my_dir(folder + "/");
 	if (!boost::filesystem::exists(my_dir))
 	{
@@ -226,32 +916,368 @@ void MultiscaleCascadeICF::load(const std::string &folder, const std::string &fa
 			continue;
 		if (!boost::algorithm::contains(p.filename().string(), family_name))
 			continue;
-		if (p.extension().string() != ".icf")
+		std::string ext = p.extension().string();
+		if (ext != ".icf" && ext != ".icfb")
+			continue;
+		if (ext == ".icf" && boost::filesystem::exists(
+			boost::filesystem::path(p).replace_extension(".icfb")))
 			continue;
 
 		std::string fname = p.generic_string();
-		workers.push_back(CascadeICF());
-		CascadeICF &my_model = workers.back();
-		my_model.load(fname);
-		if (my_model.valid)
+		CascadeICF my_model;
+		CascadeICFCompiled my_compiled;
+		if (ext == ".icfb")
 		{
-			if (my_model.win.tile_w < min_w)
-				min_w = my_model.win.tile_w;
-			if (my_model.win.tile_h < min_h)
-				min_h = my_model.win.tile_h;
-			if (my_model.win.tile_w > max_w)
-				max_w = my_model.win.tile_w;
-			if (my_model.win.tile_h > max_h)
-				max_h = my_model.win.tile_h;
+			//workers[n].run() and scaled copies need the tree form
+			if (my_compiled.load(fname))
+				my_compiled.decompile(my_model);
 		}
 		else
-			workers.pop_back();
+		{
+			my_model.load(fname);
+			my_compiled.compile(my_model, 0);
+		}
+		if (!my_model.valid || !my_compiled.valid)
+			continue;
+
+		if (my_model.win.tile_w < min_w)
+			min_w = my_model.win.tile_w;
+		if (my_model.win.tile_h < min_h)
+			min_h = my_model.win.tile_h;
+		if (my_model.win.tile_w > max_w)
+			max_w = my_model.win.tile_w;
+		if (my_model.win.tile_h > max_h)
+			max_h = my_model.win.tile_h;
+		workers.push_back(my_model);
+		compiled.push_back(my_compiled);
 	}
 
-	std::sort(workers.begin(), workers.end(), cascade_icf_ascent);
+	std::vector<CascadeICF> models;
+	std::vector<CascadeICFCompiled> packed;
+	models.swap(workers);
+	packed.swap(compiled);
+	std::vector<int> order(models.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = (int)i;
+	std::sort(order.begin(), order.end(), CascadeICFIndexAscent(models));
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		workers.push_back(models[order[i]]);
+		compiled.push_back(packed[order[i]]);
+	}
 	valid = !workers.empty();
 }
 
+ClassifierResult MultiscaleCascadeICF::process(
+	const cv::Mat &mat, int x, int y, int win_w, int win_h) const
+{
+	ClassifierResult res;
+	int index = get_worker_index(win_w, win_h);
+	if (index >= (int)workers.size())
+	{
+		res.fail = true;
+		return res;
+	}
+
+	const CascadeICF &w = workers[index];
+	w.run(&res, (classifier_input_t*)mat.ptr<classifier_input_t>(y) + x * w.channels,
+		mat.step1(), w.sensitivity);
+	return res;
+}
+
+int PyramidParamsICF::real_step() const
+{
+	int total = scales();
+	if (real_scales <= 0 || real_scales >= total)
+		return 1;
+	return (total + real_scales - 1) / real_scales;
+}
+
+void ScanContextICF::prepare(const MultiscaleCascadeICF &model, const PyramidParamsICF &pyramid)
+{
+	int step = pyramid.real_step();
+	if (owner == &model && generation == model.generation && real_step == step &&
+		scales_per_octave == pyramid.scales_per_octave && scales == pyramid.scales())
+		return;
+
+	//copies share packed model data, only rectangle offsets are rebuilt
+	workers.assign(model.compiled.begin(), model.compiled.end());
+	for (int j = 1; j < step; ++j)
+	{
+		float scale = powf(2.0f, float(j) / pyramid.scales_per_octave);
+		for (size_t n = 0; n < model.workers.size(); ++n)
+		{
+			workers.push_back(CascadeICFCompiled());
+			//non-resizable worker stays invalid and is not scanned
+			if (!model.workers[n].resizable)
+				continue;
+			CascadeICF scaled = model.workers[n];
+			if (scaled.weak_classifiers.empty())
+				model.compiled[n].decompile(scaled);
+			scaled.create_scaled(scale);
+			workers.back().compile(scaled, 0);
+		}
+	}
+
+	owner = &model;
+	generation = model.generation;
+	real_step = step;
+	scales_per_octave = pyramid.scales_per_octave;
+	scales = pyramid.scales();
+	//levels depend on the scales
+	frame_size = cv::Size();
+	rs = 0;
+}
+
+void ScanContextICF::prepare_levels(const cv::Size &size, int channels,
+	const PyramidParamsICF &pyramid)
+{
+	if (frame_size.width == size.width && frame_size.height == size.height && rs)
+		return;
+
+	levels.clear();
+	int rows = 0;
+	for (int i = 0; i < pyramid.scales(); i += real_step)
+	{
+		float scale = powf(2.0f, -float(i) / pyramid.scales_per_octave);
+		cv::Size level_size(int(size.width * scale + 0.5f), int(size.height * scale + 0.5f));
+		if (level_size.width < 1 || level_size.height < 1)
+			break;
+
+		levels.push_back(ScanLevelICF());
+		ScanLevelICF &level = levels.back();
+		level.size = level_size;
+		level.scale = scale;
+		level.scale_index = i;
+		rows += level_size.height + 1;
+	}
+
+	//ChannelsICF::compute() fills preset integral views in place
+	integral_store.create(rows, size.width + 1, CV_32SC(channels));
+	int row = 0;
+	for (size_t l = 0; l < levels.size(); ++l)
+	{
+		ScanLevelICF &level = levels[l];
+		level.frame.integral = integral_store(
+			cv::Range(row, row + level.size.height + 1), cv::Range(0, level.size.width + 1));
+		row += level.size.height + 1;
+	}
+
+	frame_size = size;
+	bind((int)integral_store.step1());
+}
+
+void ScanContextICF::bind(int row_stride)
+{
+	for (size_t i = 0; i < workers.size(); ++i)
+		if (workers[i].valid)
+			workers[i].bind(row_stride);
+	rs = row_stride;
+}
+
+static void icf_compute_level(ScanLevelICF &level, const cv::Mat &image, int channels)
+{
+	if (level.scale_index)
+	{
+		cv::resize(image, level.image, level.size, 0, 0, cv::INTER_AREA);
+		level.frame.compute(level.image, channels);
+	}
+	else
+		level.frame.compute(image, channels);
+}
+
+//active roi pixels in frame rect [x0, x1) x [y0, y1), clipped to the frame
+static int icf_roi_count(const cv::Mat &roi_sum, int x0, int y0, int x1, int y1)
+{
+	x0 = std::max(x0, 0);
+	y0 = std::max(y0, 0);
+	x1 = std::min(x1, roi_sum.cols - 1);
+	y1 = std::min(y1, roi_sum.rows - 1);
+	if (x0 >= x1 || y0 >= y1)
+		return 0;
+	const int *top = roi_sum.ptr<int>(y0);
+	const int *bottom = roi_sum.ptr<int>(y1);
+	return bottom[x1] - bottom[x0] - top[x1] + top[x0];
+}
+
+//scan window rows [row_begin, row_end) of one worker on one level
+static void icf_scan_worker(const CascadeICFCompiled &w, const ScanLevelICF &level, int scale_n,
+	const ScanParamsICF &params, const cv::Mat &roi_sum, int row_begin, int row_end,
+	std::vector<ClassifierResult> &results, std::vector<DetectionRaw> &detections)
+{
+	const cv::Mat &integral = level.frame.integral;
+	const int img_w = integral.cols - 1;
+	const int stride_x = std::max(params.stride_x, 1);
+	const int stride_y = std::max(params.stride_y, 1);
+	const int count = (img_w - w.win.tile_w) / stride_x + 1;
+	if ((int)results.size() < count)
+		results.resize(count);
+
+	const float inv = 1.0f / level.scale;
+	const int obj_w = int(w.win.obj_w * inv + 0.5f);
+	const int obj_h = int(w.win.obj_h * inv + 0.5f);
+	for (int row = row_begin; row < row_end; ++row)
+	{
+		const int y = row * stride_y;
+		std::fill(results.begin(), results.begin() + count, ClassifierResult());
+
+		if (roi_sum.empty())
+		{
+			w.run_batch(&results[0], integral.ptr<classifier_input_t>(y),
+				stride_x * w.channels, count, params.sensitivity);
+		}
+		else
+		{
+			//object areas in frame pixels as the detections below; windows
+			//without active pixels stay failed, runs of the others are scanned
+			const int obj_y = int((y + w.win.margin_top) * inv + 0.5f);
+			if (!icf_roi_count(roi_sum, 0, obj_y, roi_sum.cols - 1, obj_y + obj_h))
+				continue;
+			int run = -1;
+			for (int i = 0; i <= count; ++i)
+			{
+				bool active = false;
+				if (i < count)
+				{
+					const int obj_x = int((i * stride_x + w.win.margin_left) * inv + 0.5f);
+					active = icf_roi_count(roi_sum, obj_x, obj_y, obj_x + obj_w, obj_y + obj_h) > 0;
+					if (!active)
+						results[i].fail = true;
+				}
+				if (active && run < 0)
+				{
+					run = i;
+				}
+				else if (!active && run >= 0)
+				{
+					w.run_batch(&results[run],
+						integral.ptr<classifier_input_t>(y) + run * stride_x * w.channels,
+						stride_x * w.channels, i - run, params.sensitivity);
+					run = -1;
+				}
+			}
+		}
+
+		for (int i = 0; i < count; ++i)
+		{
+			const ClassifierResult &res = results[i];
+			if (res.fail)
+				continue;
+
+			DetectionRaw det;
+			det.x = int((i * stride_x + w.win.margin_left) * inv + 0.5f);
+			det.y = int((y + w.win.margin_top) * inv + 0.5f);
+			det.width = obj_w;
+			det.height = obj_h;
+			det.confidence = res.score;
+			det.scale_n = scale_n;
+			det.fingerprint = res.bits_desc;
+			detections.push_back(det);
+		}
+	}
+}
+
+static void icf_run_task(TaskPool *pool, const TaskPool::task_t &task)
+{
+	if (pool)
+		pool->push(task);
+	else
+		task(0);
+}
+
+void MultiscaleCascadeICF::detect(const cv::Mat &image, std::vector<DetectionRaw> &detections,
+	const ScanParamsICF &params, ScanContextICF &ctx, TaskPool *pool) const
+{
+	detections.clear();
+	if (!valid)
+		return;
+
+	const PyramidParamsICF &pyramid = params.pyramid;
+	const int channels = workers[0].channels;
+	//levels are resized copies, so the frame decides for all of them
+	if (!ChannelsICF::check(image, channels))
+		return;
+	const int nw = (int)workers.size();
+	ctx.prepare(*this, pyramid);
+	ctx.prepare_levels(image.size(), channels, pyramid);
+
+	ctx.roi_sum.release();
+	if (!params.roi.empty())
+	{
+		if (params.roi.rows != image.rows || params.roi.cols != image.cols ||
+			params.roi.type() != CV_8UC1)
+		{
+			aifil::log_warning("ICF scan: roi is not CV_8UC1 of the frame size, ignored");
+		}
+		else
+		{
+			ctx.roi_active.create(image.rows, image.cols, CV_8UC1);
+			for (int y = 0; y < image.rows; ++y)
+			{
+				const uint8_t *src = params.roi.ptr<uint8_t>(y);
+				uint8_t *dst = ctx.roi_active.ptr<uint8_t>(y);
+				for (int x = 0; x < image.cols; ++x)
+					dst[x] = src[x] != 0;
+			}
+			cv::integral(ctx.roi_active, ctx.roi_sum, CV_32S);
+			//nothing to scan
+			if (!ctx.roi_sum.ptr<int>(image.rows)[image.cols])
+				return;
+		}
+	}
+
+	const int threads = pool ? pool->size() : 1;
+	ctx.results.resize(threads);
+	ctx.detections.resize(threads);
+	for (int t = 0; t < threads; ++t)
+		ctx.detections[t].clear();
+
+	for (size_t l = 0; l < ctx.levels.size(); ++l)
+	{
+		ScanLevelICF *level = &ctx.levels[l];
+		icf_run_task(pool, [level, &image, channels](int) {
+			icf_compute_level(*level, image, channels);
+		});
+	}
+	if (pool)
+		pool->wait();
+
+	const cv::Mat *roi_sum = &ctx.roi_sum;
+
+	const int stride_y = std::max(params.stride_y, 1);
+	const int band = std::max(params.band_rows, 1);
+	for (size_t l = 0; l < ctx.levels.size(); ++l)
+	{
+		const ScanLevelICF *level = &ctx.levels[l];
+		for (int j = 0; j < ctx.real_step && level->scale_index + j < pyramid.scales(); ++j)
+		{
+			for (int n = 0; n < nw; ++n)
+			{
+				const CascadeICFCompiled *w = &ctx.workers[j * nw + n];
+				if (!w->valid || w->win.tile_w > level->size.width ||
+					w->win.tile_h > level->size.height)
+					continue;
+
+				const int scale_n = (level->scale_index + j) * nw + n;
+				const int rows = (level->size.height - w->win.tile_h) / stride_y + 1;
+				for (int row = 0; row < rows; row += band)
+				{
+					const int row_end = std::min(row + band, rows);
+					icf_run_task(pool, [w, level, scale_n, &params, &ctx, roi_sum, row, row_end](int t) {
+						icf_scan_worker(*w, *level, scale_n, params, *roi_sum, row, row_end,
+							ctx.results[t], ctx.detections[t]);
+					});
+				}
+			}
+		}
+	}
+	if (pool)
+		pool->wait();
+
+	for (int t = 0; t < threads; ++t)
+		detections.insert(detections.end(), ctx.detections[t].begin(), ctx.detections[t].end());
+}
+
 int MultiscaleCascadeICF::get_worker_index(int obj_w, int obj_h) const
 {
 	int res = 255;
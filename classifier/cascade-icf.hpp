@@ -3,13 +3,16 @@
 
 #include "decision-tree.hpp"
 #include "classifier.hpp"
+#include "channels-icf.hpp"
 
 #include "core/raw-structures.hpp"
+#include "core/task-pool.hpp"
 #include "feature/icf.hpp"
 
 #include <opencv2/core/core.hpp>
 
 #include <stdint.h>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -35,17 +38,187 @@ struct CascadeICF : Classifier
 	ResizeCoeffsICF resize_coeffs;
 };
 
+// CascadeICF packed into one contiguous block (structure of arrays).
+// Rectangle corners are precomputed as offsets against the integral image
+// row stride, so run() evaluates exactly like CascadeICF::run() but without
+// walking DTreeICF/FeatureVectorICF objects.
+struct CascadeICFCompiled : Classifier
+{
+	CascadeICFCompiled();
+	bool compile(const CascadeICF &cascade, int rs);
+	//recompute rectangle offsets for another integral image row stride
+	void bind(int rs);
+	//rebuild tree form, e.g. to create scaled copies of a binary model
+	bool decompile(CascadeICF &cascade) const;
+
+	//binary model (.icfb): versioned header followed by the packed block;
+	//load() maps the file and uses the block in place
+	bool load(const std::string &name);
+	bool save(const std::string &name) const;
+	//indices and rectangles of the packed block are in range
+	bool check() const;
+
+	ClassifierResult run(const cv::Mat &mat, int x, int y) const;
+	void run(ClassifierResult *output, const classifier_input_t *image_ptr, float sens) const;
+	//score count windows at once, window i starts at image_ptr + i * step;
+	//AVX2/SSE2 lanes with per-lane early exit, same results as run()
+	void run_batch(ClassifierResult *output, const classifier_input_t *image_ptr,
+		int step, int count, float sens) const;
+
+	//input data channels num
+	int channels;
+	bool soft_cascade;
+	float sensitivity;
+	//integral image row stride (in elements) offsets are computed for
+	int rs;
+
+	int stages_count;
+	int features_count;
+	int rects_count;
+
+	//stages: weights (2 per stage), thresholds,
+	//feature indices (3 per stage: root, left, right; -1 if absent)
+	const float *stage_weights;
+	const float *stage_reject;
+	const float *stage_approve;
+	const int32_t *stage_features;
+
+	//features: first rectangle index (features_count + 1 values), thresholds
+	const int32_t *feature_rects;
+	const float *feature_min_val;
+
+	//rectangles: weight, channel, corners (x1 y1 x2 y2)
+	const float *rect_alpha;
+	const int32_t *rect_channel;
+	const int32_t *rect_points;
+
+	//4 offsets per rectangle (top-left, top-right, bottom-left, bottom-right)
+	std::vector<int32_t> rect_offsets;
+
+private:
+	uint64_t storage_words() const;
+	void layout(const char *base);
+	float run_feature(const classifier_input_t *image_ptr, int feature) const;
+
+	std::shared_ptr<char> storage;
+};
+
+// Image pyramid of the scan: scale i is 2^(-i / scales_per_octave).
+// Channels are computed from the resized frame only for real_scales
+// evenly spaced scales; the scales in between are covered by cascade copies
+// scaled with CascadeICF::create_scaled() and run on the nearest real scale.
+struct PyramidParamsICF
+{
+	PyramidParamsICF() : octaves(1), scales_per_octave(1), real_scales(0) {}
+
+	int octaves;
+	int scales_per_octave;
+	//0 - compute channels for every scale (exhaustive pyramid)
+	int real_scales;
+
+	int scales() const { return octaves * scales_per_octave; }
+	//distance between real scales (1 for exhaustive pyramid)
+	int real_step() const;
+};
+
+//text cascade to binary (.icfb) model
+bool convert_cascade_icf(const std::string &text_name, const std::string &binary_name);
+
+struct ScanParamsICF
+{
+	ScanParamsICF() : stride_x(4), stride_y(4), sensitivity(0), band_rows(8) {}
+
+	//window step (in pixels of the scanned scale)
+	int stride_x;
+	int stride_y;
+	float sensitivity;
+	//window rows per parallel task
+	int band_rows;
+	PyramidParamsICF pyramid;
+	//region of interest: CV_8UC1 of the frame size, non-zero pixels are
+	//active (e.g. DetectorZoneGrid::mask or a motion mask); windows whose
+	//object area has no active pixel are not scanned. Empty - whole frame.
+	//A packed DetectorZoneGrid has no mask: render it unpacked for the roi
+	//or fill the Mat from its lookup()
+	cv::Mat roi;
+};
+
+struct MultiscaleCascadeICF;
+
+struct ScanLevelICF
+{
+	//resized frame (empty for the original size)
+	cv::Mat image;
+	ChannelsICF frame;
+	cv::Size size;
+	//level size / frame size
+	float scale;
+	//pyramid scale index
+	int scale_index;
+};
+
+// Per-frame buffers of the sliding window scan.
+// Keep one per stream: channels, integral images, row results and
+// stride-bound compiled workers are reused while the frame size is the same.
+// Integral images of all levels are views of one buffer with a common
+// row stride, so every worker is bound only once.
+struct ScanContextICF
+{
+	ScanContextICF()
+		: owner(0), generation(0), rs(0), real_step(0), scales_per_octave(0), scales(0) {}
+	void prepare(const MultiscaleCascadeICF &model, const PyramidParamsICF &pyramid);
+	void prepare_levels(const cv::Size &frame_size, int channels, const PyramidParamsICF &pyramid);
+	void bind(int row_stride);
+
+	std::vector<ScanLevelICF> levels;
+	cv::Mat integral_store;
+	//compiled workers, index is j * model.workers.size() + n
+	//for cascade copy scaled by 2^(j / scales_per_octave)
+	std::vector<CascadeICFCompiled> workers;
+	//per thread buffers
+	std::vector<std::vector<ClassifierResult> > results;
+	std::vector<std::vector<DetectionRaw> > detections;
+	//summed-area table of ScanParamsICF::roi != 0 (empty without roi)
+	cv::Mat roi_sum;
+	cv::Mat roi_active;
+
+	//workers and levels are rebuilt when any of these change
+	const MultiscaleCascadeICF *owner;
+	unsigned generation;
+	int rs;
+	int real_step;
+	int scales_per_octave;
+	int scales;
+	cv::Size frame_size;
+};
+
 struct MultiscaleCascadeICF
 {
+	MultiscaleCascadeICF();
+
 	bool valid;
+	//changed by load() (unique among all models), tells scan contexts
+	//to rebuild; bump it after editing workers or compiled by hand
+	unsigned generation;
+	//load all family models from folder: binary .icfb or text .icf
+	//(text model is skipped when binary one with the same name exists)
 	void load(const std::string &folder, const std::string &family_name);
-	ClassifierResult process(const cv::Mat &mat, int x, int y, int win_w, int win_h) const {}
+	//run the worker fitting win_w x win_h at (x, y) of the integral image
+	ClassifierResult process(const cv::Mat &mat, int x, int y, int win_w, int win_h) const;
+
+	//scan every worker over every window position of every pyramid scale;
+	//DetectionRaw::scale_n is scale_index * workers.size() + worker index;
+	//with a pool, levels and (scale, worker, row band) scans are parallel tasks
+	void detect(const cv::Mat &image, std::vector<DetectionRaw> &detections,
+		const ScanParamsICF &params, ScanContextICF &ctx, TaskPool *pool = 0) const;
 
 	//find minimal classifier fully contains object
 	int get_worker_index(int obj_w, int obj_h) const;
 
 	//classifiers (sorted by size)
 	std::vector<CascadeICF> workers;
+	//workers packed for scanning (same order)
+	std::vector<CascadeICFCompiled> compiled;
 	int min_w;
 	int min_h;
 	int max_w;
@@ -0,0 +1,114 @@
+#include "channels-icf.hpp"
+
+#include <logging.hpp>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <cmath>
+#include <stdint.h>
+
+namespace anfisa {
+
+bool ChannelsICF::check(const cv::Mat &image, int ch)
+{
+	if (image.depth() != CV_8U ||
+		(image.channels() != 1 && image.channels() != 3 && image.channels() != 4))
+	{
+		aifil::log_warning("ICF channels: 8-bit gray, BGR or BGRA image expected");
+		return false;
+	}
+	const int color_ch = (image.channels() != 1 && ch >= 4) ? 3 : 1;
+	if (ch < 1 || ch - color_ch - 1 > MAX_BINS)
+	{
+		aifil::log_warning("ICF channels: unsupported channel count %d", ch);
+		return false;
+	}
+	return true;
+}
+
+bool ChannelsICF::compute(const cv::Mat &image, int ch)
+{
+	if (!check(image, ch))
+		return false;
+
+	const cv::Mat *src = &image;
+	if (image.channels() == 4)
+	{
+		cv::cvtColor(image, bgr, cv::COLOR_BGRA2BGR);
+		src = &bgr;
+	}
+	if (src->channels() == 3)
+		cv::cvtColor(*src, gray, cv::COLOR_BGR2GRAY);
+	else
+		gray = image;
+
+	int color_ch = 1;
+	if (src->channels() == 3 && ch >= 4)
+	{
+		cv::cvtColor(*src, color, cv::COLOR_BGR2Luv);
+		color_ch = 3;
+	}
+	else
+		color = gray;
+
+	const int w = gray.cols;
+	const int h = gray.rows;
+	const int bins = ch - color_ch - 1;
+	channels.create(h, w, CV_8UC(ch));
+
+	//orientation bin borders as unit vectors, angle of bin k is k * pi / bins
+	float bin_cos[MAX_BINS];
+	float bin_sin[MAX_BINS];
+	for (int k = 0; k < bins; ++k)
+	{
+		bin_cos[k] = float(cos(CV_PI * k / bins));
+		bin_sin[k] = float(sin(CV_PI * k / bins));
+	}
+
+	for (int y = 0; y < h; ++y)
+	{
+		const uint8_t *g = gray.ptr<uint8_t>(y);
+		const uint8_t *g_up = gray.ptr<uint8_t>(std::max(y - 1, 0));
+		const uint8_t *g_down = gray.ptr<uint8_t>(std::min(y + 1, h - 1));
+		const uint8_t *c = color.ptr<uint8_t>(y);
+		uint8_t *dst = channels.ptr<uint8_t>(y);
+
+		for (int x = 0; x < w; ++x, dst += ch)
+		{
+			for (int k = 0; k < color_ch; ++k)
+				dst[k] = c[x * color_ch + k];
+			if (ch == color_ch)
+				continue;
+
+			int dx = g[std::min(x + 1, w - 1)] - g[std::max(x - 1, 0)];
+			int dy = g_down[x] - g_up[x];
+			//max magnitude is 255 * sqrt(2)
+			float mag = sqrtf(float(dx * dx + dy * dy)) * 0.7071f;
+			uint8_t m = uint8_t(mag + 0.5f);
+			dst[color_ch] = m;
+
+			uint8_t *hist = dst + color_ch + 1;
+			for (int k = 0; k < bins; ++k)
+				hist[k] = 0;
+			if (bins <= 0)
+				continue;
+
+			//fold orientation to [0, pi)
+			if (dy < 0 || (dy == 0 && dx < 0))
+			{
+				dx = -dx;
+				dy = -dy;
+			}
+			int bin = 0;
+			while (bin + 1 < bins &&
+				dy * bin_cos[bin + 1] - dx * bin_sin[bin + 1] >= 0)
+				++bin;
+			hist[bin] = m;
+		}
+	}
+
+	cv::integral(channels, integral, CV_32S);
+	return true;
+}
+
+} //namespace anfisa
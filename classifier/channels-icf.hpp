@@ -0,0 +1,34 @@
+#ifndef ANFISA_CHANNELS_ICF_H
+#define ANFISA_CHANNELS_ICF_H
+
+#include <opencv2/core/core.hpp>
+
+namespace anfisa {
+
+// Integral channel features of one frame.
+// Channel order: LUV (or gray for single-channel input or < 4 channels),
+// gradient magnitude, then orientation bins over [0, pi).
+// Buffers are kept between calls, so computing frames of the same size
+// does not allocate.
+struct ChannelsICF
+{
+	static const int MAX_BINS = 32;
+
+	//input is 8-bit gray, BGR or BGRA (converted to BGR); channels is at most
+	//color + magnitude + MAX_BINS; false (nothing computed) otherwise
+	static bool check(const cv::Mat &image, int channels);
+	bool compute(const cv::Mat &image, int channels);
+
+	//CV_8UC(channels), interleaved
+	cv::Mat channels;
+	//CV_32SC(channels), (rows + 1) x (cols + 1)
+	cv::Mat integral;
+
+	cv::Mat gray;
+	cv::Mat color;
+	cv::Mat bgr;
+};
+
+} //namespace anfisa
+
+#endif // ANFISA_CHANNELS_ICF_H
@@ -1,8 +1,14 @@
 #include "decision-tree.hpp"
 
+#include "core/mapped-file.hpp"
+
+#include <logging.hpp>
+
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 
 namespace anfisa {
 
@@ -54,40 +60,105 @@ float DTreeICF::run(const integr_img_val_t *dataxy, int rs, int ch) const
 	}
 }
 
-const LeafNode* CRTree::regression(uint8_t** ptFCh, int stepImg) const
+LeafNode CRTree::get_leaf(int index) const
 {
-	//pointer to current node
-	const int* pnode = &treetable[0];
+	LeafNode res;
+	res.pfg = leaf_pfg[index];
+	res.count = leaf_offsets[index + 1] - leaf_offsets[index];
+	res.num_cp = num_cp;
+	res.votes = leaf_votes + 2 * num_cp * leaf_offsets[index];
+	return res;
+}
+
+int CRTree::regression(uint8_t** ptFCh, int stepImg) const
+{
+	//binary test 0 - left, 1 - right
+	//Note that x, y are changed since the patches are given as matrix and not as image
+	//p1 - p2 < t -> left is equal to (p1 - p2 >= t) == false
 	int node = 0;
+	for (int d = 0; d < max_depth; ++d)
+	{
+		const CRTreeNode &n = nodes[node];
+		const uint8_t *ptC = ptFCh[n.channel];
+		int p1 = ptC[n.x1 + n.y1 * stepImg];
+		int p2 = ptC[n.x2 + n.y2 * stepImg];
+		node = 2 * node + 1 + ((p1 - p2) >= n.thres);
+	}
 
-	//Go through tree until one arrives at a leaf, i.e. pnode[0]>=0)
-	while (pnode[0] == -1)
+	return nodes[node].leaf;
+}
+
+//patches per lockstep block
+static const int CRTREE_BLOCK = 64;
+
+void CRTree::regression(const CRTree *trees, int tree_count,
+	const uint8_t *channels, int plane_step, int step,
+	const int *origins, int count, int *leaves)
+{
+	int depth = 0;
+	for (int t = 0; t < tree_count; ++t)
+		depth = std::max(depth, trees[t].max_depth);
+
+	for (int i0 = 0; i0 < count; i0 += CRTREE_BLOCK)
 	{
-		//binary test 0 - left, 1 - right
-		//Note that x, y are changed since the patches are given as matrix and not as image
-		//p1 - p2 < t -> left is equal to (p1 - p2 >= t) == false
+		const int i1 = std::min(i0 + CRTREE_BLOCK, count);
+		int *state = leaves + i0 * tree_count;
+		std::fill(state, state + (i1 - i0) * tree_count, 0);
 
-		//pointer to channel
-		uint8_t* ptC = ptFCh[pnode[5]];
-		// get pixel values
-		int p1 = *(ptC + pnode[1] + pnode[2] * stepImg);
-		int p2 = *(ptC + pnode[3] + pnode[4] * stepImg);
-		// test
-		bool test = (p1 - p2) >= pnode[6];
+		//node indices live in the output until the last level
+		for (int d = 0; d < depth; ++d)
+		{
+			for (int i = i0; i < i1; ++i)
+			{
+				const uint8_t *patch = channels + origins[i];
+				int *node = leaves + i * tree_count;
+				for (int t = 0; t < tree_count; ++t)
+				{
+					if (d >= trees[t].max_depth)
+						continue;
+					const CRTreeNode &n = trees[t].nodes[node[t]];
+					const uint8_t *ptC = patch + n.channel * plane_step;
+					int p1 = ptC[n.x1 + n.y1 * step];
+					int p2 = ptC[n.x2 + n.y2 * step];
+					node[t] = 2 * node[t] + 1 + ((p1 - p2) >= n.thres);
+				}
+			}
+		}
 
-		//next node: 2 * node_id + 1 + test
-		//increment node/pointer by node_id + 1 + test
-		int incr = node + 1 + test;
-		node += incr;
-		pnode += incr * 7;
+		for (int i = i0; i < i1; ++i)
+		{
+			int *node = leaves + i * tree_count;
+			for (int t = 0; t < tree_count; ++t)
+				node[t] = trees[t].nodes[node[t]].leaf;
+		}
 	}
+}
 
-	//return leaf
-	return &leaf[pnode[0]];
+size_t CRTree::storage_words() const
+{
+	return 4 * (size_t)num_nodes + 2 * (size_t)num_leaf + 1 +
+		((size_t)2 * num_cp * num_patches + 1) / 2;
+}
+
+void CRTree::layout(const char *base)
+{
+	const int32_t *ptr = (const int32_t *)base;
+	nodes = (const CRTreeNode *)ptr;
+	ptr += 4 * num_nodes;
+	leaf_pfg = (const float *)ptr;
+	ptr += num_leaf;
+	leaf_offsets = ptr;
+	ptr += num_leaf + 1;
+	leaf_votes = (const int16_t *)ptr;
 }
 
-bool CRTree::load(const std::string &fname)
+bool CRTree::load(const std::string &fname, int patch_w_, int patch_h_)
 {
+	valid = false;
+	patch_w = patch_w_;
+	patch_h = patch_h_;
+	if (patch_w < 1 || patch_h < 1 || patch_w > INT16_MAX || patch_h > INT16_MAX)
+		return false;
 	FILE *file = fopen(fname.c_str(), "rb");
 	if (!file)
 		return false;
@@ -100,10 +171,20 @@ bool CRTree::load(const std::string &fname)
 		return false;
 	}
 
+	if (max_depth < 0 || max_depth > 24 || num_leaf < 1 || num_cp < 1)
+	{
+		fclose(file);
+		return false;
+	}
+
 	bool have_error = false;
-	num_nodes = (int)pow(2.0, int(max_depth + 1)) - 1;
-	treetable.resize(num_nodes * 7); //num_nodes x 7 matrix as vector
-	leaf.resize(num_leaf);
+	num_nodes = (1 << (max_depth + 1)) - 1;
+	//column: leafindex x1 y1 x2 y2 channel thres
+	//if node is not a leaf, leaf = -1
+	std::vector<int> treetable(num_nodes * 7); //num_nodes x 7 matrix as vector
+	std::vector<float> pfg(num_leaf);
+	std::vector<int32_t> offsets(num_leaf + 1, 0);
+	std::vector<int16_t> votes;
 
 	//read tree nodes
 	for (int n = 0; n < num_nodes && !have_error; ++n)
@@ -130,9 +211,8 @@ bool CRTree::load(const std::string &fname)
 	//read tree leafs
 	for (int l = 0; l < num_leaf && !have_error; ++l)
 	{
-		LeafNode* ptLN = &leaf[l];
 		int dummy = 0;
-		res = fscanf(file, "%d %e", &dummy, &(ptLN->pfg));
+		res = fscanf(file, "%d %e", &dummy, &pfg[l]);
 		if (res != 2)
 		{
 			have_error = true;
@@ -141,31 +221,252 @@ bool CRTree::load(const std::string &fname)
 
 		//number of positive patches
 		res = fscanf(file, "%d", &dummy);
-		if (res != 1)
+		if (res != 1 || dummy < 0)
 		{
 			have_error = true;
 			break;
 		}
 
-		ptLN->vCenter.resize(dummy);
-		for (int i = 0; i < dummy && !have_error; ++i)
+		offsets[l + 1] = offsets[l] + dummy;
+		for (int i = 0; i < dummy * num_cp && !have_error; ++i)
 		{
-			ptLN->vCenter[i].resize(num_cp);
-			for (int k = 0; k < num_cp; ++k)
+			int x = 0;
+			int y = 0;
+			res = fscanf(file, "%d %d", &x, &y);
+			if (res != 2 || x < INT16_MIN || x > INT16_MAX || y < INT16_MIN || y > INT16_MAX)
 			{
-				res = fscanf(file, "%d %d", &(ptLN->vCenter[i][k].x), &(ptLN->vCenter[i][k].y));
-				if (res != 1)
-				{
-					have_error = true;
-					break;
-				}
+				have_error = true;
+				break;
 			}
+			votes.push_back((int16_t)x);
+			votes.push_back((int16_t)y);
 		}
 	} //for each leaf
 	fclose(file);
+	if (have_error)
+		return false;
+
+	num_patches = offsets[num_leaf];
+	const size_t words = storage_words();
+	storage = std::shared_ptr<char>(new char[4 * words], std::default_delete<char[]>());
+	memset(storage.get(), 0, 4 * words);
+	layout(storage.get());
+	if (!compact(treetable, const_cast<CRTreeNode *>(nodes)))
+		return false;
+	memcpy(const_cast<float *>(leaf_pfg), &pfg[0], num_leaf * sizeof(float));
+	memcpy(const_cast<int32_t *>(leaf_offsets), &offsets[0], (num_leaf + 1) * sizeof(int32_t));
+	if (!votes.empty())
+		memcpy(const_cast<int16_t *>(leaf_votes), &votes[0], votes.size() * sizeof(int16_t));
+	if (!check())
+	{
+		aifil::log_warning("Hough forest tree tests a channel or pixel outside the patch: %s", fname.c_str());
+		storage.reset();
+		return false;
+	}
+
+	valid = true;
+	return valid;
+}
+
+bool CRTree::compact(const std::vector<int> &treetable, CRTreeNode *out) const
+{
+	for (int n = 0; n < num_nodes; ++n)
+	{
+		const int *pnode = &treetable[7 * n];
+		CRTreeNode &node = out[n];
+		const int parent = (n - 1) / 2;
+		if (n > 0 && out[parent].leaf >= 0)
+		{
+			//below a leaf: repeat it
+			node = out[parent];
+			continue;
+		}
+
+		node.reserved = 0;
+		node.leaf = pnode[0];
+		if (node.leaf >= 0)
+		{
+			if (node.leaf >= num_leaf)
+				return false;
+			node.x1 = node.y1 = node.x2 = node.y2 = 0;
+			node.thres = 0;
+			node.channel = 0;
+			continue;
+		}
+
+		//inner node on the last level
+		if (2 * n + 1 >= num_nodes)
+			return false;
+		for (int i = 1; i <= 4; ++i)
+			if (pnode[i] < INT16_MIN || pnode[i] > INT16_MAX)
+				return false;
+		if (pnode[5] < 0 || pnode[5] > UINT8_MAX ||
+			pnode[6] < INT16_MIN || pnode[6] > INT16_MAX)
+			return false;
+		node.x1 = (int16_t)pnode[1];
+		node.y1 = (int16_t)pnode[2];
+		node.x2 = (int16_t)pnode[3];
+		node.y2 = (int16_t)pnode[4];
+		node.channel = (uint8_t)pnode[5];
+		node.thres = (int16_t)pnode[6];
+	}
+	return true;
+}
 
-	valid = !have_error;
+static const char CR_TREE_MAGIC[4] = {'A', 'C', 'R', 'T'};
+static const uint32_t CR_TREE_VERSION = 2;
+static const uint32_t CR_TREE_ENDIANNESS = 0x01020304;
+
+// .crtb layout: this header, then storage_words() 32-bit words:
+// nodes (4 words each), leaf pfg, leaf offsets, packed int16 votes
+struct CRTreeFileHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t endianness;
+	uint32_t checksum;
+	uint32_t payload_words;
+
+	int32_t max_depth;
+	int32_t num_leaf;
+	int32_t num_cp;
+	int32_t num_patches;
+	int32_t patch_w;
+	int32_t patch_h;
+};
+
+bool CRTree::save_binary(const std::string &fname) const
+{
+	if (!valid)
+		return false;
+	FILE *file = fopen(fname.c_str(), "wb");
+	if (!file)
+		return false;
+
+	CRTreeFileHeader header;
+	memcpy(header.magic, CR_TREE_MAGIC, 4);
+	header.version = CR_TREE_VERSION;
+	header.endianness = CR_TREE_ENDIANNESS;
+	header.payload_words = (uint32_t)storage_words();
+	header.checksum = checksum_words(storage.get(), header.payload_words);
+	header.max_depth = max_depth;
+	header.num_leaf = num_leaf;
+	header.num_cp = num_cp;
+	header.num_patches = num_patches;
+	header.patch_w = patch_w;
+	header.patch_h = patch_h;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(storage.get(), 4, header.payload_words, file) == header.payload_words;
+	return !fclose(file) && ok;
+}
+
+bool CRTree::check() const
+{
+	if (leaf_offsets[0] != 0 || leaf_offsets[num_leaf] != num_patches)
+		return false;
+	for (int l = 0; l < num_leaf; ++l)
+		if (leaf_offsets[l + 1] < leaf_offsets[l])
+			return false;
+
+	//every node is tested (leaves pushed down test pixel 0 of channel 0),
+	//so every pixel read stays inside the patch planes
+	const int first_last_level = num_nodes / 2;
+	for (int n = 0; n < num_nodes; ++n)
+	{
+		const CRTreeNode &node = nodes[n];
+		if (node.leaf >= num_leaf || node.leaf < -1 || (node.leaf < 0 && n >= first_last_level))
+			return false;
+		if (node.channel >= CHANNELS ||
+			node.x1 < 0 || node.x1 >= patch_w || node.y1 < 0 || node.y1 >= patch_h ||
+			node.x2 < 0 || node.x2 >= patch_w || node.y2 < 0 || node.y2 >= patch_h)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool CRTree::load_binary(const std::string &fname)
+{
+	valid = false;
+	size_t size = 0;
+	std::shared_ptr<char> data = map_file(fname, size);
+	if (!data || size < sizeof(CRTreeFileHeader))
+		return false;
+
+	const CRTreeFileHeader &header = *(const CRTreeFileHeader *)data.get();
+	if (memcmp(header.magic, CR_TREE_MAGIC, 4))
+	{
+		aifil::log_warning("not a binary Hough forest tree: %s", fname.c_str());
+		return false;
+	}
+	if (header.endianness != CR_TREE_ENDIANNESS)
+	{
+		aifil::log_warning("binary Hough forest tree has wrong byte order: %s", fname.c_str());
+		return false;
+	}
+	if (header.version != CR_TREE_VERSION)
+	{
+		aifil::log_warning("unsupported binary Hough forest tree version %u: %s",
+			header.version, fname.c_str());
+		return false;
+	}
+
+	max_depth = header.max_depth;
+	num_leaf = header.num_leaf;
+	num_cp = header.num_cp;
+	num_patches = header.num_patches;
+	patch_w = header.patch_w;
+	patch_h = header.patch_h;
+	if (max_depth < 0 || max_depth > 24 || num_leaf < 1 || num_cp < 1 || num_patches < 0 ||
+		patch_w < 1 || patch_h < 1 || patch_w > INT16_MAX || patch_h > INT16_MAX)
+	{
+		aifil::log_warning("wrong binary Hough forest tree: %s", fname.c_str());
+		return false;
+	}
+	num_nodes = (1 << (max_depth + 1)) - 1;
+	//every leaf and every patch offset pair takes a payload word
+	const size_t file_words = (size - sizeof(header)) / 4;
+	if ((size_t)num_leaf > file_words || (size_t)num_patches > file_words ||
+		header.payload_words != storage_words() ||
+		size != sizeof(header) + 4 * (size_t)header.payload_words)
+	{
+		aifil::log_warning("wrong binary Hough forest tree size: %s", fname.c_str());
+		return false;
+	}
+
+	const char *payload = data.get() + sizeof(header);
+	if (checksum_words(payload, header.payload_words) != header.checksum)
+	{
+		aifil::log_warning("binary Hough forest tree checksum mismatch: %s", fname.c_str());
+		return false;
+	}
+
+	//shares ownership of the mapping, points to the block
+	storage = std::shared_ptr<char>(data, const_cast<char *>(payload));
+	layout(storage.get());
+	if (!check())
+	{
+		aifil::log_warning("wrong binary Hough forest tree: %s", fname.c_str());
+		storage.reset();
+		return false;
+	}
+
+	valid = true;
 	return valid;
 }
 
+bool convert_cr_tree(const std::string &text_name, const std::string &binary_name,
+	int patch_w, int patch_h)
+{
+	CRTree tree;
+	if (!tree.load(text_name, patch_w, patch_h))
+	{
+		aifil::log_warning("cannot load Hough forest tree: %s", text_name.c_str());
+		return false;
+	}
+	return tree.save_binary(binary_name);
+}
+
 } //namespace anfisa
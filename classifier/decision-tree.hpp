@@ -6,6 +6,9 @@
 #include <opencv2/core/core.hpp>
 
 #include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace anfisa {
 
@@ -33,48 +36,120 @@ struct IntIndex
 	bool operator<(const IntIndex& a) const { return val<a.val; }
 };
 
+// View of one leaf in the CRTree leaf arena.
 struct LeafNode
 {
-	LeafNode() {}
+	LeafNode() : pfg(0), count(0), num_cp(0), votes(0) {}
 
 	float pfg; //Probability of foreground
-	// Vectors from object center to training patches
-	std::vector<std::vector<cv::Point> > vCenter;
+	int count; //number of training patches
+	int num_cp; //center points per patch
+	// Vectors from object center to training patches:
+	// count * num_cp packed (x, y) pairs
+	const int16_t *votes;
+
+	cv::Point center(int patch, int cp) const
+	{
+		const int16_t *v = votes + 2 * (patch * num_cp + cp);
+		return cv::Point(v[0], v[1]);
+	}
 };
 
+// Compact node of the complete binary CRTree (16 bytes).
+// Leaves above max_depth are pushed down to the last level: their
+// descendants repeat the leaf index and test 0 >= thres, so every patch
+// takes exactly max_depth steps.
+struct CRTreeNode
+{
+	int16_t x1;
+	int16_t y1;
+	int16_t x2;
+	int16_t y2;
+	//go to right child if p1 - p2 >= thres
+	int16_t thres;
+	uint8_t channel;
+	uint8_t reserved;
+	//leaf index, -1 for inner nodes of the original tree
+	int32_t leaf;
+};
+
+// Regression tree of the Hough forest.
+// Nodes and the leaf arena live in one block: built by the text loader or
+// mapped in place from the binary format (.crtb), copies share the block.
+// Both loaders reject trees testing a channel past CHANNELS or a pixel
+// outside the patch_w x patch_h training patch.
 class CRTree
 {
 public:
-	CRTree() : valid(false) {}
+	//feature channels the nodes test (ChannelsCRF)
+	enum { CHANNELS = 32 };
+
+	CRTree()
+		: valid(false), patch_w(0), patch_h(0), nodes(0), max_depth(0), num_nodes(0),
+		  num_leaf(0), num_cp(0), num_patches(0), leaf_pfg(0), leaf_offsets(0),
+		  leaf_votes(0) {}
 
-	bool load(const std::string &name);
+	//text tree, trained on patch_w x patch_h patches (not stored in the text)
+	bool load(const std::string &name, int patch_w, int patch_h);
+	//binary tree: versioned header (with the patch size) followed by the
+	//block, mapped in place
+	bool load_binary(const std::string &name);
+	bool save_binary(const std::string &name) const;
 
 	//Set/Get functions
 	int GetDepth() const { return max_depth; }
 	int GetNumCenter() const { return num_cp; }
+	int GetNumLeaf() const { return num_leaf; }
+	LeafNode get_leaf(int index) const;
+	float get_pfg(int index) const { return leaf_pfg[index]; }
 
-	//Regression
-	const LeafNode* regression(uint8_t** ptFCh, int stepImg) const;
+	//Regression, returns leaf index
+	int regression(uint8_t** ptFCh, int stepImg) const;
+
+	//Batch regression of count patches over tree_count trees in lockstep.
+	//Channels are planes of one buffer (plane_step bytes apart) with
+	//row stride step; origins are patch top-left offsets inside a plane.
+	//leaves[i * tree_count + t] gets the leaf index of patch i in tree t.
+	static void regression(const CRTree *trees, int tree_count,
+		const uint8_t *channels, int plane_step, int step,
+		const int *origins, int count, int *leaves);
 
 	bool valid;
+	//training patch size
+	int patch_w;
+	int patch_h;
 
 private:
+	//build nodes from the text tree table
+	bool compact(const std::vector<int> &treetable, CRTreeNode *out) const;
+	//check the block read from a file
+	bool check() const;
+	size_t storage_words() const;
+	void layout(const char *base);
 
-	//tree table
-	//2 ^ (max_depth + 1) - 1 x 7 matrix as vector
-	//column: leafindex x1 y1 x2 y2 channel thres
-	//if node is not a leaf, leaf = -1
-	std::vector<int> treetable;
+	//complete tree, 2 ^ (max_depth + 1) - 1 nodes,
+	//children of node n are 2 * n + 1 and 2 * n + 2
+	const CRTreeNode *nodes;
 
-	int min_samples; //stop growing when number of patches is less than min_samples
 	int max_depth; //depth of the tree: 0-max_depth
 	int num_nodes; //number of nodes: 2^(max_depth+1)-1
 	int num_leaf; //number of leafs
 	int num_cp; //number of center points per patch
+	int num_patches; //training patches in all leafs
+
+	//leaf arena: leaf l owns patches leaf_offsets[l] .. leaf_offsets[l + 1] - 1,
+	//patch i has num_cp (x, y) pairs at leaf_votes[2 * num_cp * i]
+	const float *leaf_pfg;
+	const int32_t *leaf_offsets;
+	const int16_t *leaf_votes;
 
-	std::vector<LeafNode> leaf;
+	std::shared_ptr<char> storage;
 };
 
+//text tree to binary (.crtb) tree
+bool convert_cr_tree(const std::string &text_name, const std::string &binary_name,
+	int patch_w, int patch_h);
+
 } //namespace anfisa
 
 #endif  // ANFISA_DECISION_TREE_H
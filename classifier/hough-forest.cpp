@@ -0,0 +1,375 @@
+#include "hough-forest.hpp"
+
+#include <logging.hpp>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace anfisa {
+
+static inline uint8_t crf_saturate(int v)
+{
+	v = std::abs(v);
+	return uint8_t(v > 255 ? 255 : v);
+}
+
+bool ChannelsCRF::check(const cv::Mat &image)
+{
+	if (image.depth() != CV_8U ||
+		(image.channels() != 1 && image.channels() != 3 && image.channels() != 4))
+	{
+		aifil::log_warning("Hough forest channels: 8-bit gray, BGR or BGRA image expected");
+		return false;
+	}
+	return true;
+}
+
+bool ChannelsCRF::compute(const cv::Mat &image)
+{
+	if (!check(image))
+		return false;
+
+	const cv::Mat *input = &image;
+	if (image.channels() == 4)
+	{
+		cv::cvtColor(image, bgr, cv::COLOR_BGRA2BGR);
+		input = &bgr;
+	}
+	if (input->channels() == 3)
+	{
+		cv::cvtColor(*input, gray, cv::COLOR_BGR2GRAY);
+		cv::cvtColor(*input, color, cv::COLOR_BGR2Lab);
+	}
+	else
+	{
+		gray = image;
+		color = cv::Mat();
+	}
+
+	const int w = gray.cols;
+	const int h = gray.rows;
+	size = gray.size();
+	planes.create(CHANNELS * h, w, CV_8UC1);
+
+	const int bins = 9;
+	uint8_t *dst[CHANNELS / 2];
+	for (int y = 0; y < h; ++y)
+	{
+		const uint8_t *g = gray.ptr<uint8_t>(y);
+		const uint8_t *g_up = gray.ptr<uint8_t>(std::max(y - 1, 0));
+		const uint8_t *g_down = gray.ptr<uint8_t>(std::min(y + 1, h - 1));
+		const uint8_t *c = color.empty() ? 0 : color.ptr<uint8_t>(y);
+		for (int k = 0; k < CHANNELS / 2; ++k)
+			dst[k] = planes.ptr<uint8_t>(k * h + y);
+
+		for (int x = 0; x < w; ++x)
+		{
+			const int xl = std::max(x - 1, 0);
+			const int xr = std::min(x + 1, w - 1);
+
+			if (c)
+			{
+				dst[0][x] = c[3 * x];
+				dst[1][x] = c[3 * x + 1];
+				dst[2][x] = c[3 * x + 2];
+			}
+			else
+			{
+				dst[0][x] = g[x];
+				dst[1][x] = 128;
+				dst[2][x] = 128;
+			}
+
+			//3x3 Sobel of gray, scaled by 1/4
+			int sx = (g_up[xr] - g_up[xl]) + 2 * (g[xr] - g[xl]) + (g_down[xr] - g_down[xl]);
+			int sy = (g_down[xl] - g_up[xl]) + 2 * (g_down[x] - g_up[x]) + (g_down[xr] - g_up[xr]);
+			int sxx = (g_up[xl] - 2 * g_up[x] + g_up[xr]) + 2 * (g[xl] - 2 * g[x] + g[xr]) +
+				(g_down[xl] - 2 * g_down[x] + g_down[xr]);
+			int syy = (g_up[xl] - 2 * g[xl] + g_down[xl]) + 2 * (g_up[x] - 2 * g[x] + g_down[x]) +
+				(g_up[xr] - 2 * g[xr] + g_down[xr]);
+			dst[3][x] = crf_saturate(sx / 4);
+			dst[4][x] = crf_saturate(sy / 4);
+			dst[5][x] = crf_saturate(sxx / 4);
+			dst[6][x] = crf_saturate(syy / 4);
+
+			for (int k = 0; k < bins; ++k)
+				dst[7 + k][x] = 0;
+			//fold orientation to [0, pi)
+			if (sy < 0 || (sy == 0 && sx < 0))
+			{
+				sx = -sx;
+				sy = -sy;
+			}
+			float angle = atan2f(float(sy), float(sx));
+			int bin = std::min(int(angle * bins / float(CV_PI)), bins - 1);
+			dst[7 + bin][x] = crf_saturate(int(sqrtf(float(sx * sx + sy * sy)) * 0.25f));
+		}
+	}
+
+	if (kernel.empty())
+		kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(5, 5));
+	for (int k = 0; k < CHANNELS / 2; ++k)
+	{
+		cv::Mat src = planes.rowRange(k * h, (k + 1) * h);
+		cv::Mat dst_min = planes.rowRange((k + CHANNELS / 2) * h, (k + CHANNELS / 2 + 1) * h);
+		cv::erode(src, dst_min, kernel);
+		cv::dilate(src, filtered, kernel);
+		filtered.copyTo(src);
+	}
+	return true;
+}
+
+static void crf_run_task(TaskPool *pool, const TaskPool::task_t &task)
+{
+	if (pool)
+		pool->push(task);
+	else
+		task(0);
+}
+
+bool CRForest::load(const std::string &prefix, int count, int patch_w_, int patch_h_,
+	TaskPool *pool)
+{
+	valid = false;
+	patch_w = patch_w_;
+	patch_h = patch_h_;
+	trees.assign(std::max(count, 0), CRTree());
+	std::vector<char> loaded(trees.size(), 0);
+	for (int i = 0; i < count; ++i)
+	{
+		crf_run_task(pool, [this, &prefix, &loaded, i](int) {
+			char name[16];
+			snprintf(name, sizeof(name), "%03d.crtb", i);
+			FILE *file = fopen((prefix + name).c_str(), "rb");
+			if (file)
+			{
+				fclose(file);
+				loaded[i] = trees[i].load_binary(prefix + name) &&
+					trees[i].patch_w == patch_w && trees[i].patch_h == patch_h;
+				return;
+			}
+			snprintf(name, sizeof(name), "%03d.txt", i);
+			loaded[i] = trees[i].load(prefix + name, patch_w, patch_h);
+		});
+	}
+	if (pool)
+		pool->wait();
+
+	for (int i = 0; i < count; ++i)
+	{
+		if (!loaded[i])
+		{
+			aifil::log_warning("cannot load Hough forest tree %d: %s", i, prefix.c_str());
+			trees.clear();
+			return false;
+		}
+	}
+
+	valid = !trees.empty();
+	return valid;
+}
+
+static void crf_vote_band(const CRForest &forest, const HoughLevelCRF &level,
+	const HoughParamsCRF &params, int row, int row_end,
+	std::vector<int> &origins, std::vector<int> &leaves, cv::Mat &votes)
+{
+	const ChannelsCRF &f = level.frame;
+	const int step = (int)f.planes.step;
+	const int stride = std::max(params.stride, 1);
+	const int nx = (f.size.width - params.patch_w) / stride + 1;
+	const int nt = (int)forest.trees.size();
+
+	origins.clear();
+	for (int r = row; r < row_end; ++r)
+		for (int i = 0; i < nx; ++i)
+			origins.push_back(r * stride * step + i * stride);
+	if (origins.empty())
+		return;
+	leaves.resize(origins.size() * nt);
+	CRTree::regression(&forest.trees[0], nt, f.plane(0), f.plane_step(), step,
+		&origins[0], (int)origins.size(), &leaves[0]);
+
+	float *acc = votes.ptr<float>(0);
+	const int acc_step = (int)votes.step1();
+	for (size_t k = 0; k < origins.size(); ++k)
+	{
+		const int cx = int(k % nx) * stride + params.patch_w / 2;
+		const int cy = (row + int(k / nx)) * stride + params.patch_h / 2;
+		for (int t = 0; t < nt; ++t)
+		{
+			const CRTree &tree = forest.trees[t];
+			const int l = leaves[k * nt + t];
+			if (tree.get_pfg(l) < params.min_pfg)
+				continue;
+			const LeafNode leaf = tree.get_leaf(l);
+			if (!leaf.count)
+				continue;
+
+			const float w = leaf.pfg / float(leaf.count * nt);
+			const int16_t *v = leaf.votes;
+			for (int i = 0; i < leaf.count; ++i, v += 2 * leaf.num_cp)
+			{
+				const int x = cx - v[0];
+				const int y = cy - v[1];
+				if (x >= 0 && y >= 0 && x < votes.cols && y < votes.rows)
+					acc[y * acc_step + x] += w;
+			}
+		}
+	}
+}
+
+static void crf_find_peaks(HoughLevelCRF &level, const std::vector<std::vector<cv::Mat> > &votes,
+	int l, const HoughParamsCRF &params, std::vector<DetectionRaw> &detections)
+{
+	cv::Mat &hough = level.hough;
+	votes[0][l].copyTo(hough);
+	for (size_t t = 1; t < votes.size(); ++t)
+	{
+		for (int y = 0; y < hough.rows; ++y)
+		{
+			float *dst = hough.ptr<float>(y);
+			const float *src = votes[t][l].ptr<float>(y);
+			for (int x = 0; x < hough.cols; ++x)
+				dst[x] += src[x];
+		}
+	}
+
+	if (params.blur_sigma > 0)
+	{
+		const int k = 2 * int(ceilf(3 * params.blur_sigma)) + 1;
+		cv::GaussianBlur(hough, hough, cv::Size(k, k), params.blur_sigma);
+	}
+
+	const int rad = std::max(params.peak_radius, 0);
+	const float box_w = params.object_w / level.scale;
+	const float box_h = params.object_h / level.scale;
+	for (int y = 0; y < hough.rows; ++y)
+	{
+		const float *row = hough.ptr<float>(y);
+		for (int x = 0; x < hough.cols; ++x)
+		{
+			const float v = row[x];
+			if (v < params.threshold)
+				continue;
+
+			//strict maximum, ties go to the first pixel in scan order
+			bool peak = true;
+			for (int yy = std::max(y - rad, 0); yy <= std::min(y + rad, hough.rows - 1) && peak; ++yy)
+			{
+				const float *r = hough.ptr<float>(yy);
+				for (int xx = std::max(x - rad, 0); xx <= std::min(x + rad, hough.cols - 1); ++xx)
+				{
+					if (r[xx] > v || (r[xx] == v && (yy < y || (yy == y && xx < x))))
+					{
+						peak = false;
+						break;
+					}
+				}
+			}
+			if (!peak)
+				continue;
+
+			DetectionRaw d;
+			d.x = int(x / level.scale - box_w / 2);
+			d.y = int(y / level.scale - box_h / 2);
+			d.width = int(box_w);
+			d.height = int(box_h);
+			d.confidence = v;
+			d.scale_n = l;
+			d.fingerprint = 0;
+			detections.push_back(d);
+		}
+	}
+}
+
+void CRForest::detect(const cv::Mat &image, std::vector<DetectionRaw> &detections,
+	const HoughParamsCRF &params, ScanContextCRF &ctx, TaskPool *pool) const
+{
+	detections.clear();
+	if (!valid || image.empty() || !ChannelsCRF::check(image))
+		return;
+	if (params.patch_w != patch_w || params.patch_h != patch_h)
+	{
+		aifil::log_warning("Hough forest trained on %dx%d patches, params have %dx%d",
+			patch_w, patch_h, params.patch_w, params.patch_h);
+		return;
+	}
+
+	const int nl = params.scales.empty() ? 1 : (int)params.scales.size();
+	const int threads = pool ? pool->size() : 1;
+	ctx.levels.resize(nl);
+	ctx.origins.resize(threads);
+	ctx.leaves.resize(threads);
+	ctx.votes.resize(threads);
+	ctx.detections.resize(threads);
+	for (int t = 0; t < threads; ++t)
+	{
+		ctx.votes[t].resize(nl);
+		ctx.detections[t].clear();
+	}
+
+	for (int l = 0; l < nl; ++l)
+	{
+		HoughLevelCRF *level = &ctx.levels[l];
+		level->scale = params.scales.empty() ? 1.0f : params.scales[l];
+		crf_run_task(pool, [level, l, &image, &ctx](int) {
+			if (level->scale == 1.0f)
+			{
+				level->image.release();
+				level->frame.compute(image);
+			}
+			else
+			{
+				cv::Size size(std::max(int(image.cols * level->scale + 0.5f), 1),
+					std::max(int(image.rows * level->scale + 0.5f), 1));
+				cv::resize(image, level->image, size, 0, 0, cv::INTER_AREA);
+				level->frame.compute(level->image);
+			}
+			for (size_t t = 0; t < ctx.votes.size(); ++t)
+			{
+				ctx.votes[t][l].create(level->frame.size, CV_32FC1);
+				ctx.votes[t][l].setTo(cv::Scalar(0));
+			}
+		});
+	}
+	if (pool)
+		pool->wait();
+
+	const int stride = std::max(params.stride, 1);
+	const int band = std::max(params.band_rows, 1);
+	for (int l = 0; l < nl; ++l)
+	{
+		const HoughLevelCRF *level = &ctx.levels[l];
+		if (level->frame.size.width < params.patch_w || level->frame.size.height < params.patch_h)
+			continue;
+		const int ny = (level->frame.size.height - params.patch_h) / stride + 1;
+		for (int row = 0; row < ny; row += band)
+		{
+			const int row_end = std::min(row + band, ny);
+			crf_run_task(pool, [this, level, l, &params, &ctx, row, row_end](int t) {
+				crf_vote_band(*this, *level, params, row, row_end,
+					ctx.origins[t], ctx.leaves[t], ctx.votes[t][l]);
+			});
+		}
+	}
+	if (pool)
+		pool->wait();
+
+	for (int l = 0; l < nl; ++l)
+	{
+		HoughLevelCRF *level = &ctx.levels[l];
+		crf_run_task(pool, [level, l, &params, &ctx](int t) {
+			crf_find_peaks(*level, ctx.votes, l, params, ctx.detections[t]);
+		});
+	}
+	if (pool)
+		pool->wait();
+
+	for (int t = 0; t < threads; ++t)
+		detections.insert(detections.end(), ctx.detections[t].begin(), ctx.detections[t].end());
+}
+
+} //namespace anfisa
@@ -0,0 +1,127 @@
+#ifndef ANFISA_HOUGH_FOREST_H
+#define ANFISA_HOUGH_FOREST_H
+
+#include "decision-tree.hpp"
+
+#include "core/raw-structures.hpp"
+#include "core/task-pool.hpp"
+
+#include <opencv2/core/core.hpp>
+
+#include <string>
+#include <vector>
+
+namespace anfisa {
+
+// Hough forest feature channels (Gall & Lempitsky), 32 planes:
+// 0-2 Lab, 3-4 |Ix| |Iy|, 5-6 |Ixx| |Iyy|, 7-15 orientation bins over [0, pi),
+// all max-filtered 5x5; planes 16-31 are the same 16 channels min-filtered.
+// Buffers are kept between calls.
+struct ChannelsCRF
+{
+	enum { CHANNELS = CRTree::CHANNELS };
+
+	//input is 8-bit gray, BGR or BGRA (converted to BGR); false (nothing
+	//computed) otherwise
+	static bool check(const cv::Mat &image);
+	bool compute(const cv::Mat &image);
+
+	//plane stride in bytes, planes are stacked vertically in one CV_8UC1 image
+	int plane_step() const { return size.height * (int)planes.step; }
+	const uint8_t *plane(int c) const { return planes.ptr<uint8_t>(c * size.height); }
+
+	//CV_8UC1, (CHANNELS * rows) x cols
+	cv::Mat planes;
+	cv::Size size;
+
+	cv::Mat gray;
+	cv::Mat color;
+	cv::Mat bgr;
+	cv::Mat filtered;
+	cv::Mat kernel;
+};
+
+struct HoughParamsCRF
+{
+	HoughParamsCRF()
+		: patch_w(16), patch_h(16), object_w(64), object_h(128), stride(2),
+		  min_pfg(0.5f), blur_sigma(2.0f), threshold(1.0f), peak_radius(8),
+		  band_rows(8) {}
+
+	//training patch size
+	int patch_w;
+	int patch_h;
+	//object size at scale 1
+	int object_w;
+	int object_h;
+	//patch grid step (in pixels of the scaled image)
+	int stride;
+	//image scales, empty - only original size
+	std::vector<float> scales;
+	//leaves with lower foreground probability do not vote
+	float min_pfg;
+	//Hough image smoothing, 0 - no smoothing
+	float blur_sigma;
+	//minimal peak value
+	float threshold;
+	//peak is the maximum within this radius (Hough image pixels)
+	int peak_radius;
+	//patch grid rows per parallel task
+	int band_rows;
+};
+
+struct HoughLevelCRF
+{
+	//resized frame (empty for the original size)
+	cv::Mat image;
+	ChannelsCRF frame;
+	//CV_32FC1 votes, same size as the level
+	cv::Mat hough;
+	float scale;
+};
+
+// Per-stream buffers of Hough voting, reused between frames.
+struct ScanContextCRF
+{
+	std::vector<HoughLevelCRF> levels;
+	//per thread buffers: patch origins, leaf indices, vote images per level
+	std::vector<std::vector<int> > origins;
+	std::vector<std::vector<int> > leaves;
+	std::vector<std::vector<cv::Mat> > votes;
+	std::vector<std::vector<DetectionRaw> > detections;
+};
+
+// Class-specific Hough forest: every patch of a dense grid is passed
+// through all trees, each reached leaf casts pfg-weighted votes for the
+// object center at its offsets; peaks of the smoothed vote images are
+// the detections.
+struct CRForest
+{
+	CRForest() : valid(false), patch_w(0), patch_h(0) {}
+
+	//trees are prefix000 ... prefix<count - 1>: binary .crtb,
+	//or text .txt when there is no binary one, all trained on
+	//patch_w x patch_h patches (binary trees with another size fail);
+	//with a pool, trees are loaded in parallel
+	bool load(const std::string &prefix, int count, int patch_w, int patch_h,
+		TaskPool *pool = 0);
+
+	//DetectionRaw::scale_n is the index in params.scales,
+	//confidence is the smoothed vote value at the peak;
+	//with a pool, levels and patch row bands are parallel tasks
+	//voting into per-thread accumulators; nothing is detected when
+	//params.patch_w/patch_h differ from the training patch size or the
+	//image is not one ChannelsCRF::check() accepts
+	void detect(const cv::Mat &image, std::vector<DetectionRaw> &detections,
+		const HoughParamsCRF &params, ScanContextCRF &ctx, TaskPool *pool = 0) const;
+
+	std::vector<CRTree> trees;
+	bool valid;
+	//training patch size of all trees
+	int patch_w;
+	int patch_h;
+};
+
+} //namespace anfisa
+
+#endif // ANFISA_HOUGH_FOREST_H
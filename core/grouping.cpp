@@ -0,0 +1,345 @@
+#include "grouping.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace anfisa {
+
+void BoxGrid::reset(float left, float top, float right, float bottom, float cell_size)
+{
+	x0 = left;
+	y0 = top;
+	cell = std::max(cell_size, 1.0f);
+	//keep the grid size sane for degenerate inputs
+	while ((right - left) / cell * (bottom - top) / cell > float(1 << 20))
+		cell *= 2;
+	cols = int((right - left) / cell) + 1;
+	rows = int((bottom - top) / cell) + 1;
+	head.assign(cols * rows, -1);
+	next.clear();
+	items.clear();
+}
+
+void BoxGrid::cells(float left, float top, float right, float bottom,
+	int &c0, int &r0, int &c1, int &r1) const
+{
+	c0 = std::min(std::max(int(floorf((left - x0) / cell)), 0), cols - 1);
+	r0 = std::min(std::max(int(floorf((top - y0) / cell)), 0), rows - 1);
+	c1 = std::min(std::max(int(floorf((right - x0) / cell)), 0), cols - 1);
+	r1 = std::min(std::max(int(floorf((bottom - y0) / cell)), 0), rows - 1);
+}
+
+void BoxGrid::insert(int item, float left, float top, float right, float bottom)
+{
+	int c0, r0, c1, r1;
+	cells(left, top, right, bottom, c0, r0, c1, r1);
+	for (int r = r0; r <= r1; ++r)
+	{
+		for (int c = c0; c <= c1; ++c)
+		{
+			int &h = head[r * cols + c];
+			next.push_back(h);
+			items.push_back(item);
+			h = (int)items.size() - 1;
+		}
+	}
+}
+
+static float detection_iou(const DetectionRaw &a, const DetectionRaw &b)
+{
+	int w = std::min(a.x + a.width, b.x + b.width) - std::max(a.x, b.x);
+	int h = std::min(a.y + a.height, b.y + b.height) - std::max(a.y, b.y);
+	if (w <= 0 || h <= 0)
+		return 0;
+	float inter = float(w) * h;
+	return inter / (float(a.width) * a.height + float(b.width) * b.height - inter);
+}
+
+struct ConfidenceDescent
+{
+	ConfidenceDescent(const std::vector<DetectionRaw> &d) : dets(d) {}
+	bool operator()(int i, int j) const { return dets[i].confidence > dets[j].confidence; }
+	const std::vector<DetectionRaw> &dets;
+};
+
+void DetectionGrouping::prepare_grid(const std::vector<DetectionRaw> &detections)
+{
+	float left = detections[0].x;
+	float top = detections[0].y;
+	float right = left;
+	float bottom = top;
+	double size = 0;
+	for (size_t i = 0; i < detections.size(); ++i)
+	{
+		const DetectionRaw &d = detections[i];
+		left = std::min(left, float(d.x));
+		top = std::min(top, float(d.y));
+		right = std::max(right, float(d.x + d.width));
+		bottom = std::max(bottom, float(d.y + d.height));
+		size += std::max(d.width, d.height);
+	}
+	//boxes cover a few cells each
+	grid.reset(left, top, right, bottom, float(0.5 * size / detections.size()));
+}
+
+void DetectionGrouping::nms(std::vector<DetectionRaw> &detections, float iou_threshold)
+{
+	const int n = (int)detections.size();
+	if (!n)
+		return;
+
+	order.resize(n);
+	for (int i = 0; i < n; ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), ConfidenceDescent(detections));
+
+	prepare_grid(detections);
+	stamp.assign(n, -1);
+	output.clear();
+
+	for (int k = 0; k < n; ++k)
+	{
+		const DetectionRaw &d = detections[order[k]];
+		int c0, r0, c1, r1;
+		grid.cells(d.x, d.y, d.x + d.width, d.y + d.height, c0, r0, c1, r1);
+
+		//kept boxes are in confidence order, so the lowest index wins
+		int best = -1;
+		for (int r = r0; r <= r1; ++r)
+		{
+			for (int c = c0; c <= c1; ++c)
+			{
+				for (int e = grid.head[r * grid.cols + c]; e >= 0; e = grid.next[e])
+				{
+					int j = grid.items[e];
+					if (stamp[j] == k)
+						continue;
+					stamp[j] = k;
+					if ((best < 0 || j < best) && detection_iou(d, output[j]) > iou_threshold)
+						best = j;
+				}
+			}
+		}
+
+		if (best >= 0)
+		{
+			++output[best].neighbours;
+			continue;
+		}
+
+		output.push_back(d);
+		output.back().neighbours = 1;
+		grid.insert((int)output.size() - 1, d.x, d.y, d.x + d.width, d.y + d.height);
+	}
+
+	detections.assign(output.begin(), output.end());
+}
+
+int DetectionGrouping::find_group(float mx, float my, float ms, const GroupingParams &params) const
+{
+	//modes closer than half of the bandwidth are merged
+	const float sxy = params.sigma_xy * exp2f(ms);
+	int c0, r0, c1, r1;
+	group_grid.cells(mx - sxy, my - sxy, mx + sxy, my + sxy, c0, r0, c1, r1);
+
+	int found = -1;
+	for (int r = r0; r <= r1; ++r)
+	{
+		for (int c = c0; c <= c1; ++c)
+		{
+			for (int e = group_grid.head[r * group_grid.cols + c]; e >= 0; e = group_grid.next[e])
+			{
+				int g = group_grid.items[e];
+				if (found >= 0 && g >= found)
+					continue;
+				const float *m = &modes[3 * g];
+				if (fabsf(m[0] - mx) < 0.5f * sxy && fabsf(m[1] - my) < 0.5f * sxy &&
+					fabsf(m[2] - ms) < 0.5f * params.sigma_scale)
+					found = g;
+			}
+		}
+	}
+	return found;
+}
+
+int DetectionGrouping::find_basin(int i, const GroupingParams &params) const
+{
+	//a point starting next to an already shifted one ends in the same mode
+	const float *p = &points[4 * i];
+	const float sxy = 0.25f * params.sigma_xy * exp2f(p[2]);
+	const float ss = 0.25f * params.sigma_scale;
+	int c0, r0, c1, r1;
+	grid.cells(p[0] - sxy, p[1] - sxy, p[0] + sxy, p[1] + sxy, c0, r0, c1, r1);
+	for (int r = r0; r <= r1; ++r)
+	{
+		for (int c = c0; c <= c1; ++c)
+		{
+			for (int e = grid.head[r * grid.cols + c]; e >= 0; e = grid.next[e])
+			{
+				int j = grid.items[e];
+				const float *q = &points[4 * j];
+				if (owner[j] >= 0 && fabsf(q[0] - p[0]) < sxy && fabsf(q[1] - p[1]) < sxy &&
+					fabsf(q[2] - p[2]) < ss)
+					return owner[j];
+			}
+		}
+	}
+	return -1;
+}
+
+void DetectionGrouping::group(std::vector<DetectionRaw> &detections, const GroupingParams &params)
+{
+	const int n = (int)detections.size();
+	if (!n)
+		return;
+
+	//points: center x, center y, log2 width, aspect ratio
+	points.resize(4 * n);
+	double mean_w = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		const DetectionRaw &d = detections[i];
+		float w = float(std::max(d.width, 1));
+		points[4 * i] = d.x + 0.5f * d.width;
+		points[4 * i + 1] = d.y + 0.5f * d.height;
+		points[4 * i + 2] = log2f(w);
+		points[4 * i + 3] = d.height / w;
+		mean_w += w;
+	}
+	mean_w /= n;
+
+	float left = points[0];
+	float top = points[1];
+	float right = left;
+	float bottom = top;
+	for (int i = 1; i < n; ++i)
+	{
+		left = std::min(left, points[4 * i]);
+		top = std::min(top, points[4 * i + 1]);
+		right = std::max(right, points[4 * i]);
+		bottom = std::max(bottom, points[4 * i + 1]);
+	}
+	grid.reset(left, top, right, bottom, float(2 * params.sigma_xy * mean_w));
+	for (int i = 0; i < n; ++i)
+		grid.insert(i, points[4 * i], points[4 * i + 1], points[4 * i], points[4 * i + 1]);
+	group_grid.reset(left, top, right, bottom, float(params.sigma_xy * mean_w));
+
+	order.resize(n);
+	for (int i = 0; i < n; ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), ConfidenceDescent(detections));
+
+	//groups: mode (x, y, log2 width); sums: aspect ratio sum, best confidence
+	modes.clear();
+	groups.clear();
+	output.clear();
+	owner.assign(n, -1);
+	stamp.assign(n, -1);
+	int visit = 0;
+	for (int k = 0; k < n; ++k)
+	{
+		const int i = order[k];
+		float mx = points[4 * i];
+		float my = points[4 * i + 1];
+		float ms = points[4 * i + 2];
+		int found = find_group(mx, my, ms, params);
+		if (found < 0)
+			found = find_basin(i, params);
+		for (int it = 0; it < params.iterations && found < 0; ++it)
+		{
+			const float sxy = params.sigma_xy * exp2f(ms);
+			const float ss = params.sigma_scale;
+			int c0, r0, c1, r1;
+			grid.cells(mx - 3 * sxy, my - 3 * sxy, mx + 3 * sxy, my + 3 * sxy, c0, r0, c1, r1);
+
+			double sum_w = 0;
+			double sum_x = 0;
+			double sum_y = 0;
+			double sum_s = 0;
+			++visit;
+			for (int r = r0; r <= r1; ++r)
+			{
+				for (int c = c0; c <= c1; ++c)
+				{
+					for (int e = grid.head[r * grid.cols + c]; e >= 0; e = grid.next[e])
+					{
+						int j = grid.items[e];
+						if (stamp[j] == visit)
+							continue;
+						stamp[j] = visit;
+
+						float dx = (points[4 * j] - mx) / sxy;
+						float dy = (points[4 * j + 1] - my) / sxy;
+						float ds = (points[4 * j + 2] - ms) / ss;
+						float d2 = dx * dx + dy * dy + ds * ds;
+						if (d2 > 9)
+							continue;
+						double w = (std::max(detections[j].confidence, 0.0f) + 1e-3f) * exp(-0.5 * d2);
+						sum_w += w;
+						sum_x += w * points[4 * j];
+						sum_y += w * points[4 * j + 1];
+						sum_s += w * points[4 * j + 2];
+					}
+				}
+			}
+			if (sum_w <= 0)
+				break;
+
+			float nx = float(sum_x / sum_w);
+			float ny = float(sum_y / sum_w);
+			float ns = float(sum_s / sum_w);
+			bool converged = fabsf(nx - mx) < 0.01f * sxy && fabsf(ny - my) < 0.01f * sxy &&
+				fabsf(ns - ms) < 0.01f * ss;
+			mx = nx;
+			my = ny;
+			ms = ns;
+			found = find_group(mx, my, ms, params);
+			if (converged)
+				break;
+		}
+
+		const DetectionRaw &d = detections[i];
+		if (found < 0)
+		{
+			found = (int)output.size();
+			modes.push_back(mx);
+			modes.push_back(my);
+			modes.push_back(ms);
+			groups.push_back(0);
+			groups.push_back(d.confidence);
+			output.push_back(d);
+			output.back().neighbours = 0;
+			output.back().confidence = 0;
+			group_grid.insert(found, mx, my, mx, my);
+		}
+
+		//members come in confidence order, the first one is the best
+		owner[i] = found;
+		DetectionRaw &g = output[found];
+		++g.neighbours;
+		groups[2 * found] += points[4 * i + 3];
+		if (params.sum_confidence)
+			g.confidence += d.confidence;
+		else
+			g.confidence = groups[2 * found + 1];
+	}
+
+	detections.clear();
+	for (size_t k = 0; k < output.size(); ++k)
+	{
+		DetectionRaw &g = output[k];
+		if (g.neighbours < params.min_neighbours)
+			continue;
+
+		const float *m = &modes[3 * k];
+		float w = exp2f(m[2]);
+		float h = w * groups[2 * k] / g.neighbours;
+		g.x = int(m[0] - 0.5f * w + 0.5f);
+		g.y = int(m[1] - 0.5f * h + 0.5f);
+		g.width = int(w + 0.5f);
+		g.height = int(h + 0.5f);
+		detections.push_back(g);
+	}
+}
+
+}  // namespace anfisa
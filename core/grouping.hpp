@@ -0,0 +1,85 @@
+#ifndef ANFISA_GROUPING_H
+#define ANFISA_GROUPING_H
+
+#include "raw-structures.hpp"
+
+#include <vector>
+
+namespace anfisa {
+
+// Uniform grid of boxes for local overlap queries.
+// Every box is linked into all cells it covers.
+struct BoxGrid
+{
+	BoxGrid() : x0(0), y0(0), cell(1), cols(0), rows(0) {}
+	void reset(float left, float top, float right, float bottom, float cell_size);
+	void insert(int item, float left, float top, float right, float bottom);
+	//cell range covering box (inclusive)
+	void cells(float left, float top, float right, float bottom,
+		int &c0, int &r0, int &c1, int &r1) const;
+
+	float x0;
+	float y0;
+	float cell;
+	int cols;
+	int rows;
+	//linked lists per cell: head[cell] -> next[entry], -1 terminated
+	std::vector<int> head;
+	std::vector<int> next;
+	std::vector<int> items;
+};
+
+struct GroupingParams
+{
+	GroupingParams()
+		: sigma_xy(0.15f), sigma_scale(0.25f), iterations(20),
+		  min_neighbours(1), sum_confidence(false) {}
+
+	//mean shift bandwidth: position (relative to box size) and log2 scale
+	float sigma_xy;
+	float sigma_scale;
+	int iterations;
+	//groups with fewer members are dropped
+	int min_neighbours;
+	//group confidence is the sum (true) or the maximum of members
+	bool sum_confidence;
+};
+
+// Non-maximum suppression and grouping of raw window hits.
+// Candidate lookups go through a BoxGrid, so cost grows with the number of
+// overlapping boxes instead of n^2. Buffers are kept between calls.
+// Use raw_to_results() to convert the survivors to ResultDetection.
+class DetectionGrouping
+{
+public:
+	//greedy IoU NMS: keep the most confident box, drop boxes overlapping it
+	//above iou_threshold; neighbours counts the kept box and boxes it dropped
+	void nms(std::vector<DetectionRaw> &detections, float iou_threshold);
+
+	//mean shift over (center x, center y, log2 width): every detection moves
+	//to its mode, detections with the same mode form one group with
+	//neighbours = members; detections are shifted in confidence order and
+	//stop as soon as they reach an already found mode or start next to a
+	//detection already assigned to a mode
+	void group(std::vector<DetectionRaw> &detections, const GroupingParams &params);
+
+private:
+	void prepare_grid(const std::vector<DetectionRaw> &detections);
+
+	int find_group(float mx, float my, float ms, const GroupingParams &params) const;
+	int find_basin(int i, const GroupingParams &params) const;
+
+	BoxGrid grid;
+	BoxGrid group_grid;
+	std::vector<int> order;
+	std::vector<int> stamp;
+	std::vector<int> owner;
+	std::vector<float> points;
+	std::vector<float> modes;
+	std::vector<float> groups;
+	std::vector<DetectionRaw> output;
+};
+
+}  // namespace anfisa
+
+#endif  // ANFISA_GROUPING_H
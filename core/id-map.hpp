@@ -0,0 +1,228 @@
+#ifndef ANFISA_ID_MAP_H
+#define ANFISA_ID_MAP_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace anfisa {
+
+// Hash map keyed by object id for per frame bookkeeping.
+// Open addressing with linear probing over a power of two table kept at
+// most half full; erase() shifts the following entries of the cluster back,
+// so there are no tombstones. Every slot carries the generation it was
+// written in and clear() only bumps the map generation, so a map cleared
+// and refilled every frame is O(1) to clear and allocates only when it
+// grows past its largest size. Iteration goes in slot order, not by id.
+template <typename T>
+class IdMap
+{
+	struct Slot
+	{
+		Slot() : gen(0) {}
+		std::pair<int, T> value;
+		unsigned gen;
+	};
+
+public:
+	typedef std::pair<int, T> value_type;
+
+	template <typename S, typename V>
+	class iterator_t
+	{
+	public:
+		iterator_t() : slot(0), last(0), gen(0) {}
+		iterator_t(S *slot_, S *last_, unsigned gen_)
+			: slot(slot_), last(last_), gen(gen_) { skip(); }
+
+		operator iterator_t<const Slot, const value_type>() const
+		{
+			return iterator_t<const Slot, const value_type>(slot, last, gen);
+		}
+
+		V &operator*() const { return slot->value; }
+		V *operator->() const { return &slot->value; }
+		iterator_t &operator++() { ++slot; skip(); return *this; }
+		bool operator==(const iterator_t &other) const { return slot == other.slot; }
+		bool operator!=(const iterator_t &other) const { return slot != other.slot; }
+
+	private:
+		void skip()
+		{
+			while (slot != last && slot->gen != gen)
+				++slot;
+		}
+
+		S *slot;
+		S *last;
+		unsigned gen;
+	};
+
+	typedef iterator_t<Slot, value_type> iterator;
+	typedef iterator_t<const Slot, const value_type> const_iterator;
+
+	IdMap() : gen(1), used(0), mask(0), shift(32) {}
+
+	size_t size() const { return used; }
+	bool empty() const { return !used; }
+
+	void clear()
+	{
+		used = 0;
+		if (++gen == 0)
+		{
+			for (size_t i = 0; i < slots.size(); ++i)
+				slots[i].gen = 0;
+			gen = 1;
+		}
+	}
+
+	void reserve(size_t count)
+	{
+		if (count * 2 > slots.size())
+			rehash(count * 2);
+	}
+
+	iterator begin() { return iterator(data(), data() + slots.size(), gen); }
+	iterator end() { return iterator(data() + slots.size(), data() + slots.size(), gen); }
+	const_iterator begin() const { return const_iterator(data(), data() + slots.size(), gen); }
+	const_iterator end() const
+	{
+		return const_iterator(data() + slots.size(), data() + slots.size(), gen);
+	}
+
+	iterator find(int id)
+	{
+		const int i = lookup(id);
+		return i < 0 ? end() : iterator(data() + i, data() + slots.size(), gen);
+	}
+
+	const_iterator find(int id) const
+	{
+		const int i = lookup(id);
+		return i < 0 ? end() : const_iterator(data() + i, data() + slots.size(), gen);
+	}
+
+	size_t count(int id) const { return lookup(id) >= 0 ? 1 : 0; }
+
+	T &operator[](int id)
+	{
+		const int i = lookup(id);
+		if (i >= 0)
+			return slots[i].value.second;
+
+		if ((used + 1) * 2 > slots.size())
+			rehash(std::max<size_t>(16, slots.size() * 2));
+		size_t k = home(id);
+		while (slots[k].gen == gen)
+			k = (k + 1) & mask;
+		slots[k].gen = gen;
+		slots[k].value = value_type(id, T());
+		++used;
+		return slots[k].value.second;
+	}
+
+	size_t erase(int id)
+	{
+		const int i = lookup(id);
+		if (i < 0)
+			return 0;
+		remove(i);
+		return 1;
+	}
+
+	//erase entries pred(value) is true for, one pass over the table
+	template <typename Pred>
+	void erase_if(Pred pred)
+	{
+		//remove() only moves entries into the freed slot from later in the
+		//cluster (or from the already visited table start), so the slot is
+		//checked again before moving on
+		for (size_t i = 0; i < slots.size() && used;)
+		{
+			if (slots[i].gen == gen && pred(const_cast<const value_type &>(slots[i].value)))
+				remove(i);
+			else
+				++i;
+		}
+	}
+
+private:
+	Slot *data() { return slots.empty() ? 0 : &slots[0]; }
+	const Slot *data() const { return slots.empty() ? 0 : &slots[0]; }
+
+	//Fibonacci hashing: top bits of the product
+	size_t home(int id) const
+	{
+		return shift >= 32 ? 0 : size_t((uint32_t(id) * 2654435769u) >> shift);
+	}
+
+	int lookup(int id) const
+	{
+		if (!used)
+			return -1;
+		for (size_t k = home(id);; k = (k + 1) & mask)
+		{
+			const Slot &s = slots[k];
+			if (s.gen != gen)
+				return -1;
+			if (s.value.first == id)
+				return (int)k;
+		}
+	}
+
+	void remove(size_t hole)
+	{
+		--used;
+		for (size_t k = (hole + 1) & mask; slots[k].gen == gen; k = (k + 1) & mask)
+		{
+			//an entry may fill the hole if the hole is between its home and k
+			const size_t h = home(slots[k].value.first);
+			if (((k - h) & mask) >= ((k - hole) & mask))
+			{
+				slots[hole].value = slots[k].value;
+				hole = k;
+			}
+		}
+		slots[hole].gen = gen - 1;
+	}
+
+	void rehash(size_t count)
+	{
+		size_t size = 16;
+		int bits = 4;
+		while (size < count)
+		{
+			size *= 2;
+			++bits;
+		}
+		if (size <= slots.size())
+			return;
+
+		std::vector<Slot> old(size);
+		old.swap(slots);
+		mask = size - 1;
+		shift = 32 - bits;
+		const size_t n = used;
+		used = 0;
+		const unsigned old_gen = gen;
+		gen = 1;
+		for (size_t i = 0; i < old.size() && used < n; ++i)
+		{
+			if (old[i].gen == old_gen)
+				(*this)[old[i].value.first] = old[i].value.second;
+		}
+	}
+
+	std::vector<Slot> slots;
+	unsigned gen;
+	size_t used;
+	size_t mask;
+	int shift;
+};
+
+}  // namespace anfisa
+
+#endif  // ANFISA_ID_MAP_H
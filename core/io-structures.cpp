@@ -5,9 +5,16 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
 namespace anfisa {
 
 const int DetectorZoneParams::MAX_POINTS = 50;
+const size_t ResultTrack::DEFAULT_CAPACITY = 256;
 
 ResultDetection::ResultDetection()
 	: confidence(0), type(OBJECT_CLASS_UNKNOWN), ts(0)
@@ -37,42 +44,194 @@ void ResultDetection::set_rect(const cv::Rect &rect, int frame_w, int frame_h)
 	height = rect.height * 100.0f / frame_h;
 }
 
+void ResultDetection::set_raw(const DetectionRaw &det, int frame_w, int frame_h)
+{
+	set_rect(cv::Rect(det.x, det.y, det.width, det.height), frame_w, frame_h);
+	confidence = det.confidence;
+	id = det.id;
+	fingerprint.assign(1, det.fingerprint);
+}
+
+void raw_to_results(const std::vector<DetectionRaw> &raw, int frame_w, int frame_h,
+	std::vector<ResultDetection> &results)
+{
+	results.resize(raw.size());
+	for (size_t i = 0; i < raw.size(); ++i)
+		results[i].set_raw(raw[i], frame_w, frame_h);
+}
+
+void ResultTrack::push_back(const Point &point)
+{
+	Point pt = point;
+	pt.seq = next_seq++;
+
+	if (!points.empty())
+	{
+		const Point &last = points.back();
+		path_len += sqrtf((pt.x - last.x) * (pt.x - last.x) + (pt.y - last.y) * (pt.y - last.y));
+	}
+
+	if (decimate && points.full() && points.size() >= 4)
+	{
+		//keep points 0, 2, 4 ... of the older half and the newer half as is,
+		//so this runs once per capacity / 4 points
+		const size_t n = points.size();
+		size_t dst = 1;
+		for (size_t src = 2; src < n; ++src)
+		{
+			if (src >= n / 2 || src % 2 == 0)
+				points[dst++] = points[src];
+		}
+		while (points.size() > dst)
+			points.pop_back();
+	}
+	points.push_back(pt);
+}
+
+void ResultTrack::clear()
+{
+	points.clear();
+	path_len = 0;
+}
+
+//bitwise, so a NaN point equals itself
+static bool same_track_point(const ResultTrack::Point &a, const ResultTrack::Point &b)
+{
+	return a.ts == b.ts && !memcmp(&a.x, &b.x, sizeof(a.x)) && !memcmp(&a.y, &b.y, sizeof(a.y));
+}
+
+size_t ResultTrack::unseen_from(const Point &seen) const
+{
+	const size_t n = points.size();
+	if (!seen.seq || !n || !points.front().seq || !points.back().seq)
+		return 0;
+	//a restarted track numbers from 1 again
+	if (points.back().seq < seen.seq)
+		return 0;
+
+	size_t lo = 0;
+	size_t hi = n;
+	while (lo < hi)
+	{
+		const size_t mid = (lo + hi) / 2;
+		if (points[mid].seq <= seen.seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	//decimation or eviction may have dropped the seen point; if it is
+	//still there it has to be the same point
+	if (lo && points[lo - 1].seq == seen.seq && !same_track_point(points[lo - 1], seen))
+		return 0;
+	return lo;
+}
+
 ResultTarget::ResultTarget()
 	: ready(false), icon_w(0), icon_h(0)
 {
 }
 
+//printf("%0.2f", v): the exact binary value rounded half to even
+static void figure_append_number(std::string &out, double v)
+{
+	if (!(std::fabs(v) < 1e15))
+	{
+		//inf, nan and huge values are rare, printf knows them best
+		char buf[512];
+		snprintf(buf, sizeof(buf), "%0.2f", v);
+		out += buf;
+		return;
+	}
+
+	//|v| = mant * 2^k, mant < 2^53, so 100 * mant < 2^60 is exact
+	int exp = 0;
+	const double m = frexp(std::fabs(v), &exp);
+	const uint64_t mant = uint64_t(ldexp(m, 53));
+	const int k = exp - 53;
+	const uint64_t t = mant * 100;
+	uint64_t n = 0;
+	if (k >= 0)
+	{
+		n = t << k;
+	}
+	else if (k > -64)
+	{
+		const int shift = -k;
+		n = t >> shift;
+		const uint64_t rem = t & ((uint64_t(1) << shift) - 1);
+		const uint64_t half = uint64_t(1) << (shift - 1);
+		if (rem > half || (rem == half && (n & 1)))
+			++n;
+	}
+
+	char buf[24];
+	char *p = buf + sizeof(buf);
+	*--p = char('0' + n % 10);
+	*--p = char('0' + n / 10 % 10);
+	*--p = '.';
+	uint64_t whole = n / 100;
+	do
+	{
+		*--p = char('0' + whole % 10);
+		whole /= 10;
+	} while (whole);
+	if (std::signbit(v))
+		*--p = '-';
+	out.append(p, buf + sizeof(buf) - p);
+}
+
+//"<name> a b c d <color><suffix>\0", the figure of render_figures_text()
+static void figure_append(std::string &out, const char *name, double a, double b, double c, double d,
+	const std::string &color, const char *suffix = "")
+{
+	out += name;
+	figure_append_number(out, a);
+	out += ' ';
+	figure_append_number(out, b);
+	out += ' ';
+	figure_append_number(out, c);
+	out += ' ';
+	figure_append_number(out, d);
+	out += ' ';
+	out += color.c_str();
+	out += suffix;
+	out += '\0';
+}
+
 std::string ResultTarget::render_figures_text(const std::string &color_rect,
 	const std::string &color_track,
 	const std::string &color_shape,
 	const std::string &color_velocity) const
 {
 	std::string fig;
+	append_figures_text(fig, color_rect, color_track, color_shape, color_velocity);
+	return fig;
+}
+
+void ResultTarget::append_figures_text(std::string &fig,
+	const std::string &color_rect,
+	const std::string &color_track,
+	const std::string &color_shape,
+	const std::string &color_velocity) const
+{
 	if (!color_rect.empty())
 	{
-		fig += aifil::stdprintf("rect %0.2f %0.2f %0.2f %0.2f %s",
+		figure_append(fig, "rect ",
 			center_x - width / 2, center_y - height / 2,
 			center_x + width / 2, center_y + height / 2,
-			color_rect.c_str());
-		fig += std::string("", 1);
+			color_rect);
 	}
 	if (!color_track.empty() && track.points.size() > 2)
 	{
-		std::list<ResultTrack::Point>::const_iterator tr_it = track.points.begin();
-		std::list<ResultTrack::Point>::const_iterator tr_next = tr_it;
-		++tr_next;
-		for (; tr_next != track.points.end(); ++tr_it, ++tr_next)
+		const size_t n = track.points.size();
+		for (size_t j = 0; j + 1 < n; ++j)
 		{
-			const ResultTrack::Point& p0 = *tr_it;
-			const ResultTrack::Point& p1 = *tr_next;
-			fig += aifil::stdprintf("line %0.2lf %0.2lf %0.2lf %0.2lf %s",
-				p0.x, p0.y, p1.x, p1.y, color_track.c_str());
-			fig += std::string("", 1);
+			const ResultTrack::Point &p0 = track.points[j];
+			const ResultTrack::Point &p1 = track.points[j + 1];
+			figure_append(fig, "line ", p0.x, p0.y, p1.x, p1.y, color_track);
 		}
-		const ResultTrack::Point& p0 = *tr_it;
-		fig += aifil::stdprintf("line %0.2lf %0.2lf %0.2lf %0.2lf %s",
-			p0.x, p0.y, center_x, center_y, color_track.c_str());
-		fig += std::string("", 1);
+		const ResultTrack::Point &p0 = track.points[n - 1];
+		figure_append(fig, "line ", p0.x, p0.y, center_x, center_y, color_track);
 	}
 	if (!color_shape.empty() && shape.size() > 2)
 	{
@@ -80,44 +239,156 @@ std::string ResultTarget::render_figures_text(const std::string &color_rect,
 		{
 			const cv::Point2f &p0 = shape[j];
 			const cv::Point2f &p1 = shape[j + 1];
-			fig += aifil::stdprintf("line %0.2f %0.2f %0.2f %0.2f %s",
-				p0.x, p0.y, p1.x, p1.y, color_shape.c_str());
-			fig += std::string("", 1);
+			figure_append(fig, "line ", p0.x, p0.y, p1.x, p1.y, color_shape);
 		}
 		//contour must be closed
 		const cv::Point2f &p0 = shape[0];
 		const cv::Point2f &p1 = shape[shape.size() - 1];
-		fig += aifil::stdprintf("line %0.2lf %0.2lf %0.2lf %0.2lf %s",
-			p0.x, p0.y, p1.x, p1.y, color_shape.c_str());
-		fig += std::string("", 1);
+		figure_append(fig, "line ", p0.x, p0.y, p1.x, p1.y, color_shape);
 	}
 	if (!color_velocity.empty())
 	{
-		fig += aifil::stdprintf("line %0.2f %0.2f %0.2f %0.2f %s",
+		figure_append(fig, "line ",
 			center_x, center_y,
 			center_x + 30 * speed_x,
 			center_y + 30 * speed_y,
-			color_velocity.c_str());
-		fig += std::string("", 1);
+			color_velocity);
+	}
+}
+
+void append_figures_text(std::string &fig, const std::vector<ResultTarget> &targets,
+	const std::string &color_rect,
+	const std::string &color_track,
+	const std::string &color_shape,
+	const std::string &color_velocity)
+{
+	for (size_t i = 0; i < targets.size(); ++i)
+		targets[i].append_figures_text(fig, color_rect, color_track, color_shape, color_velocity);
+}
+
+//set bits [x0, x1) of a bit row to value
+static void grid_fill_bits(uint8_t *row, int x0, int x1, bool value)
+{
+	while (x0 < x1 && (x0 & 7))
+	{
+		if (value)
+			row[x0 >> 3] |= uint8_t(1 << (x0 & 7));
+		else
+			row[x0 >> 3] &= uint8_t(~(1 << (x0 & 7)));
+		++x0;
+	}
+	if (x1 - x0 >= 8)
+	{
+		const int bytes = (x1 - x0) >> 3;
+		memset(row + (x0 >> 3), value ? 0xff : 0, bytes);
+		x0 += bytes * 8;
+	}
+	for (; x0 < x1; ++x0)
+	{
+		if (value)
+			row[x0 >> 3] |= uint8_t(1 << (x0 & 7));
+		else
+			row[x0 >> 3] &= uint8_t(~(1 << (x0 & 7)));
+	}
+}
+
+void DetectorZoneGrid::fill_cell(int cx, int cy)
+{
+	const uint8_t value = mask_string[grid_w * cy + cx];
+	const int x0 = col_start[cx];
+	const int x1 = col_start[cx + 1];
+	for (int y = row_start[cy]; y < row_start[cy + 1]; ++y)
+	{
+		if (packed)
+			grid_fill_bits(&mask_bits[y * bits_stride], x0, x1, value != 0);
+		else
+			memset(&mask[y * image_w + x0], value, x1 - x0);
 	}
-	return fig;
 }
 
 void DetectorZoneGrid::render()
 {
 	af_assert(image_w && image_h && grid_w && grid_h);
 	af_assert(grid_w < image_w && grid_h < image_h);
+	af_assert((int)mask_string.size() >= grid_w * grid_h);
+
+	//pixel x is in column grid_w * x / image_w, so column c starts at the
+	//first x with grid_w * x >= c * image_w; same for rows
+	col_start.resize(grid_w + 1);
+	for (int c = 0; c <= grid_w; ++c)
+		col_start[c] = (c * image_w + grid_w - 1) / grid_w;
+	row_start.resize(grid_h + 1);
+	for (int r = 0; r <= grid_h; ++r)
+		row_start[r] = (r * image_h + grid_h - 1) / grid_h;
+
+	bits_stride = (image_w + 7) / 8;
+	if (packed)
+	{
+		std::vector<uint8_t>().swap(mask);
+		mask_bits.resize(bits_stride * image_h);
+	}
+	else
+	{
+		std::vector<uint8_t>().swap(mask_bits);
+		mask.resize(image_w * image_h);
+	}
 
-	mask.resize(image_w * image_h, 0);
-
-	for (int y = 0; y < image_h; ++y)
-		for (int x = 0; x < image_w; ++x)
-			mask[y * image_w + x] =
-				mask_string[grid_w * (grid_h * y / image_h) + grid_w * x / image_w];
+	//first row of every grid row cell by cell, the others are copies
+	const size_t row_size = packed ? bits_stride : image_w;
+	for (int cy = 0; cy < grid_h; ++cy)
+	{
+		const int y0 = row_start[cy];
+		const int y1 = row_start[cy + 1];
+		if (y0 == y1)
+			continue;
+		uint8_t *first = packed ? &mask_bits[y0 * row_size] : &mask[y0 * row_size];
+		for (int cx = 0; cx < grid_w; ++cx)
+		{
+			const uint8_t value = mask_string[grid_w * cy + cx];
+			if (packed)
+				grid_fill_bits(first, col_start[cx], col_start[cx + 1], value != 0);
+			else
+				memset(first + col_start[cx], value, col_start[cx + 1] - col_start[cx]);
+		}
+		for (int y = y0 + 1; y < y1; ++y)
+			memcpy(first + (y - y0) * row_size, first, row_size);
+	}
 
+	rendered.assign(mask_string.begin(), mask_string.begin() + grid_w * grid_h);
+	rendered_w = grid_w;
+	rendered_h = grid_h;
+	rendered_image_w = image_w;
+	rendered_image_h = image_h;
+	rendered_packed = packed;
 	is_valid = true;
 }
 
+int DetectorZoneGrid::update()
+{
+	if (!is_valid || grid_w != rendered_w || grid_h != rendered_h ||
+		image_w != rendered_image_w || image_h != rendered_image_h || packed != rendered_packed)
+	{
+		render();
+		return grid_w * grid_h;
+	}
+	af_assert((int)mask_string.size() >= grid_w * grid_h);
+
+	int changed = 0;
+	for (int cy = 0; cy < grid_h; ++cy)
+	{
+		for (int cx = 0; cx < grid_w; ++cx)
+		{
+			const int i = grid_w * cy + cx;
+			if (mask_string[i] == rendered[i])
+				continue;
+			fill_cell(cx, cy);
+			rendered[i] = mask_string[i];
+			++changed;
+		}
+	}
+	return changed;
+}
+
 DetectorZoneParams::DetectorZoneParams()
 {
 	exists = false;
@@ -133,8 +404,262 @@ DetectorZoneParams::DetectorZoneParams()
 	max_obj_track_len = 0;
 }
 
+int zone_type_from_string(const std::string &type)
+{
+	if (type == "lookup")
+		return ZONE_TYPE_LOOKUP;
+	if (type == "ignore")
+		return ZONE_TYPE_IGNORE;
+	if (type == "border")
+		return ZONE_TYPE_BORDER;
+	if (type == "border_swapped")
+		return ZONE_TYPE_BORDER_SWAPPED;
+	return ZONE_TYPE_UNKNOWN;
+}
+
+void DetectorZoneIndex::build(const std::string &zone_type, const std::vector<double> &points)
+{
+	type = zone_type_from_string(zone_type);
+	vertices.clear();
+	slab_y.clear();
+	slab_start.clear();
+	slab_edges.clear();
+
+	const int n = int(points.size() / 2);
+	for (int j = 0; j < n; ++j)
+		vertices.push_back(cv::Point(int(points[2 * j]), int(points[2 * j + 1])));
+
+	min_x = min_y = FLT_MAX;
+	max_x = max_y = -FLT_MAX;
+	for (int j = 0; j < n; ++j)
+	{
+		min_x = std::min(min_x, vertices[j].x);
+		max_x = std::max(max_x, vertices[j].x);
+		min_y = std::min(min_y, vertices[j].y);
+		max_y = std::max(max_y, vertices[j].y);
+		slab_y.push_back(vertices[j].y);
+	}
+	std::sort(slab_y.begin(), slab_y.end());
+	slab_y.erase(std::unique(slab_y.begin(), slab_y.end()), slab_y.end());
+
+	for (int k = 0; k + 1 < (int)slab_y.size(); ++k)
+	{
+		slab_start.push_back((int)slab_edges.size());
+		for (int i = 0; i < n; ++i)
+		{
+			const cv::Point2f &v0 = vertices[(i + n - 1) % n];
+			const cv::Point2f &v = vertices[i];
+			if (std::min(v0.y, v.y) <= slab_y[k] && std::max(v0.y, v.y) >= slab_y[k + 1])
+				slab_edges.push_back(i);
+		}
+	}
+	slab_start.push_back((int)slab_edges.size());
+	valid = true;
+}
+
+//edge test of cv::pointPolygonTest() (floating point branch, no distance):
+//-1 - edge is skipped, 0 - point is on the edge, 1 - crossing, 2 - no crossing
+static inline int zone_edge_test(const cv::Point2f &v0, const cv::Point2f &v, const cv::Point2f &pt)
+{
+	if ((v0.y <= pt.y && v.y <= pt.y) ||
+		(v0.y > pt.y && v.y > pt.y) ||
+		(v0.x < pt.x && v.x < pt.x))
+	{
+		if (pt.y == v.y && (pt.x == v.x || (pt.y == v0.y &&
+			((v0.x <= pt.x && pt.x <= v.x) || (v.x <= pt.x && pt.x <= v0.x)))))
+			return 0;
+		return -1;
+	}
+
+	double dist = (double)(pt.y - v0.y) * (v.x - v0.x) - (double)(pt.x - v0.x) * (v.y - v0.y);
+	if (dist == 0)
+		return 0;
+	if (v.y < v0.y)
+		dist = -dist;
+	return dist > 0 ? 1 : 2;
+}
+
+bool DetectorZoneIndex::inside_full(float x, float y) const
+{
+	const cv::Point2f pt(x, y);
+	const int n = (int)vertices.size();
+	int counter = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		int res = zone_edge_test(vertices[(i + n - 1) % n], vertices[i], pt);
+		if (!res)
+			return true;
+		counter += res == 1;
+	}
+	return counter % 2 == 1;
+}
+
+bool DetectorZoneIndex::inside(float x, float y) const
+{
+	//outside the y range (or NaN) every edge is skipped and no vertex
+	//shares y with the point; right of all vertices every edge is skipped
+	//and the point cannot lie on one
+	if (!(y >= min_y && y <= max_y) || x > max_x)
+		return false;
+
+	std::vector<float>::const_iterator it = std::upper_bound(slab_y.begin(), slab_y.end(), y);
+	const int k = int(it - slab_y.begin()) - 1;
+	if (slab_y[k] == y)
+		return inside_full(x, y);
+
+	//inside the slab: spanning edges only, the point is never on a vertex y
+	const cv::Point2f pt(x, y);
+	const int n = (int)vertices.size();
+	int counter = 0;
+	for (int e = slab_start[k]; e < slab_start[k + 1]; ++e)
+	{
+		const int i = slab_edges[e];
+		int res = zone_edge_test(vertices[(i + n - 1) % n], vertices[i], pt);
+		if (!res)
+			return true;
+		counter += res == 1;
+	}
+	return counter % 2 == 1;
+}
+
+void DetectorZoneBorders::add_edge(double edge_x1, double edge_y1, double edge_x2, double edge_y2)
+{
+	x1.push_back(float(edge_x1));
+	y1.push_back(float(edge_y1));
+	x2.push_back(float(edge_x2));
+	y2.push_back(float(edge_y2));
+	dx.push_back(x2.back() - x1.back());
+	dy.push_back(y2.back() - y1.back());
+	++edge_count;
+}
+
+void DetectorZoneBorders::build(const std::string &zone_type, const std::vector<double> &points)
+{
+	type = zone_type_from_string(zone_type);
+	edge_count = 0;
+	x1.clear();
+	y1.clear();
+	x2.clear();
+	y2.clear();
+	dx.clear();
+	dy.clear();
+	valid = type != ZONE_TYPE_UNKNOWN;
+	if (type == ZONE_TYPE_UNKNOWN || type == ZONE_TYPE_IGNORE)
+		return;
+
+	//same edges and order as the raw loop: consecutive points, then the
+	//closing edge for lookup zones
+	const int size = int(points.size());
+	for (int j = 0; 2 * j + 3 < size; ++j)
+		add_edge(points[2 * j], points[2 * j + 1], points[2 * j + 2], points[2 * j + 3]);
+	if (type == ZONE_TYPE_LOOKUP && size >= 2)
+		add_edge(points[size - 2], points[size - 1], points[0], points[1]);
+}
+
+//the crossing test of check_borders() for edge i
+inline bool DetectorZoneBorders::edge_cross(int i, float obj_x0, float obj_y0, float obj_x1, float obj_y1) const
+{
+	return (((obj_x0 - x1[i]) * dy[i] - (obj_y0 - y1[i]) * dx[i]) *
+		((obj_x1 - x1[i]) * dy[i] - (obj_y1 - y1[i]) * dx[i]) <= 0) &&
+		(((x1[i] - obj_x0) * (obj_y1 - obj_y0) - (y1[i] - obj_y0) * (obj_x1 - obj_x0)) *
+		((x2[i] - obj_x0) * (obj_y1 - obj_y0) - (y2[i] - obj_y0) * (obj_x1 - obj_x0)) <= 0);
+}
+
+int DetectorZoneBorders::cross(float obj_x0, float obj_y0, float obj_x1, float obj_y1, int *edge) const
+{
+	if (edge)
+		*edge = -1;
+	const int n = edge_count;
+
+	//collinear edges pass the test anywhere on their line, so no spatial
+	//filter can skip an edge without changing the result; blocks of edges
+	//are tested without branches (same expression as edge_cross()) and
+	//only a hit block is walked again
+	const int BLOCK = 8;
+	const float sx = obj_x1 - obj_x0;
+	const float sy = obj_y1 - obj_y0;
+	int first = 0;
+	for (; first + BLOCK <= n; first += BLOCK)
+	{
+		const float *ax = &x1[first];
+		const float *ay = &y1[first];
+		const float *bx = &x2[first];
+		const float *by = &y2[first];
+		const float *ex = &dx[first];
+		const float *ey = &dy[first];
+		int hit = 0;
+		for (int k = 0; k < BLOCK; ++k)
+		{
+			const float c0 = (obj_x0 - ax[k]) * ey[k] - (obj_y0 - ay[k]) * ex[k];
+			const float c1 = (obj_x1 - ax[k]) * ey[k] - (obj_y1 - ay[k]) * ex[k];
+			const float d0 = (ax[k] - obj_x0) * sy - (ay[k] - obj_y0) * sx;
+			const float d1 = (bx[k] - obj_x0) * sy - (by[k] - obj_y0) * sx;
+			hit |= (c0 * c1 <= 0) & (d0 * d1 <= 0);
+		}
+		if (hit)
+			break;
+	}
+	for (; first < n; ++first)
+	{
+		if (edge_cross(first, obj_x0, obj_y0, obj_x1, obj_y1))
+			break;
+	}
+
+	if (first == n)
+		return 0;
+	if (edge)
+		*edge = first;
+	if (type == ZONE_TYPE_LOOKUP)
+		return 1;
+	const bool left2right =
+		(obj_x0 - x1[first]) * dy[first] - (obj_y0 - y1[first]) * dx[first] < 0;
+	if (type == ZONE_TYPE_BORDER)
+		return left2right ? 1 : -1;
+	return left2right ? -1 : 1;
+}
+
+int DetectorZoneBorders::cross(const float *segments, int count, int *directions) const
+{
+	int first = -1;
+	for (int i = 0; i < count; ++i, segments += 4)
+	{
+		directions[i] = cross(segments[0], segments[1], segments[2], segments[3]);
+		if (directions[i] && first < 0)
+			first = i;
+	}
+	return first;
+}
+
+void DetectorZoneParams::compile()
+{
+	index.build(type, points);
+	borders.build(type, points);
+	compiled_type = type;
+	compiled_points = points;
+}
+
+bool DetectorZoneParams::compiled() const
+{
+	//bitwise, so NaN points compare equal to themselves
+	return type == compiled_type && points.size() == compiled_points.size() &&
+		(points.empty() || !memcmp(&points[0], &compiled_points[0], points.size() * sizeof(double)));
+}
+
 bool DetectorZoneParams::is_inside(float obj_x, float obj_y) const
 {
+	return is_inside(obj_x, obj_y, compiled());
+}
+
+int DetectorZoneParams::check_borders(float obj_x0, float obj_y0, float obj_x1, float obj_y1) const
+{
+	return check_borders(obj_x0, obj_y0, obj_x1, obj_y1, compiled());
+}
+
+bool DetectorZoneParams::is_inside(float obj_x, float obj_y, bool is_compiled) const
+{
+	if (index.valid && is_compiled)
+		return index.type == ZONE_TYPE_LOOKUP && index.inside(obj_x, obj_y);
+
 	if (type != "lookup")
 		return false;
 
@@ -149,8 +674,12 @@ bool DetectorZoneParams::is_inside(float obj_x, float obj_y) const
 	return false;
 }
 
-int DetectorZoneParams::check_borders(float obj_x0, float obj_y0, float obj_x1, float obj_y1) const
+int DetectorZoneParams::check_borders(float obj_x0, float obj_y0, float obj_x1, float obj_y1,
+	bool is_compiled) const
 {
+	if (borders.valid && is_compiled)
+		return borders.cross(obj_x0, obj_y0, obj_x1, obj_y1);
+
 	if (type == "ignore")
 		return 0;
 
@@ -209,26 +738,36 @@ int DetectorZoneParams::check_borders(float obj_x0, float obj_y0, float obj_x1,
 std::string DetectorZoneParams::render_figures_text(const std::string &color) const
 {
 	std::string fig;
+	append_figures_text(fig, color);
+	return fig;
+}
+
+int DetectorZoneParams::outline_size() const
+{
 	if (!exists)
-		return fig;
+		return 0;
 
 	int size = points.size();
 	if (size % 2)
 		size--;
 	if (size < 4)
-		return fig;
+		return 0;
 
 	if (size > 2 * MAX_POINTS)
 		size = 2 * MAX_POINTS;
+	return size;
+}
+
+bool DetectorZoneParams::label_boxes(double *box_a, double *box_b) const
+{
+	const int size = outline_size();
+	if (!size || type != "border")
+		return false;
 
 	int index_max_len = 0;
 	double max_len = 0;
 	for (int j = 0; j < size / 2 - 1; ++j)
 	{
-		fig += aifil::stdprintf("line %0.2lf %0.2lf %0.2lf %0.2lf %s",
-			points[2 * j], points[2 * j + 1], points[2 * j + 2], points[2 * j + 3],
-			color.c_str());
-		fig += std::string("", 1);
 		double len = (points[2 * j + 2] - points[2 * j]) *
 			(points[2 * j + 2] - points[2 * j]) +
 			(points[2 * j + 3] - points[2 * j + 1]) *
@@ -239,32 +778,52 @@ std::string DetectorZoneParams::render_figures_text(const std::string &color) co
 			index_max_len = 2 * j;
 		}
 	}
+	if (!(max_len > 0))
+		return false;
+
+	max_len = sqrt(max_len);
+	double x0 = points[index_max_len];
+	double y0 = points[index_max_len + 1];
+	double x1 = points[index_max_len + 2];
+	double y1 = points[index_max_len + 3];
+	double xa = (x0 + x1) / 2 - (y0 - y1) * 4 / max_len;
+	double ya = (y0 + y1) / 2 - (x1 - x0) * 5 / max_len;
+	double xb = (x0 + x1) / 2 + (y0 - y1) * 4 / max_len;
+	double yb = (y0 + y1) / 2 + (x1 - x0) * 5 / max_len;
+	box_a[0] = xa;
+	box_a[1] = ya - 3;
+	box_a[2] = xa + 4;
+	box_a[3] = ya + 3;
+	box_b[0] = xb;
+	box_b[1] = yb - 3;
+	box_b[2] = xb + 4;
+	box_b[3] = yb + 3;
+	return true;
+}
+
+void DetectorZoneParams::append_figures_text(std::string &fig, const std::string &color) const
+{
+	const int size = outline_size();
+	for (int j = 0; j < size / 2 - 1; ++j)
+	{
+		figure_append(fig, "line ",
+			points[2 * j], points[2 * j + 1], points[2 * j + 2], points[2 * j + 3], color);
+	}
+	if (!size)
+		return;
 
+	double box_a[4];
+	double box_b[4];
 	if (type != "border")
 	{
-		fig += aifil::stdprintf("line %0.2lf %0.2lf %0.2lf %0.2lf %s",
-			points[size - 2], points[size - 1], points[0], points[1], color.c_str());
-		fig += std::string("", 1);
-	}
-	else if (max_len > 0)
-	{
-		max_len = sqrt(max_len);
-		double x0 = points[index_max_len];
-		double y0 = points[index_max_len + 1];
-		double x1 = points[index_max_len + 2];
-		double y1 = points[index_max_len + 3];
-		double xa = (x0 + x1) / 2 - (y0 - y1) * 4 / max_len;
-		double ya = (y0 + y1) / 2 - (x1 - x0) * 5 / max_len;
-		double xb = (x0 + x1) / 2 + (y0 - y1) * 4 / max_len;
-		double yb = (y0 + y1) / 2 + (x1 - x0) * 5 / max_len;
-		fig += aifil::stdprintf("text %0.2lf %0.2lf %0.2lf %0.2lf %s A",
-			xa, ya - 3, xa + 4, ya + 3, color.c_str());
-		fig += std::string("", 1);
-		fig += aifil::stdprintf("text %0.2lf %0.2lf %0.2lf %0.2lf %s B",
-			xb, yb - 3, xb + 4, yb + 3, color.c_str());
-		fig += std::string("", 1);
+		figure_append(fig, "line ",
+			points[size - 2], points[size - 1], points[0], points[1], color);
+	}
+	else if (label_boxes(box_a, box_b))
+	{
+		figure_append(fig, "text ", box_a[0], box_a[1], box_a[2], box_a[3], color, " A");
+		figure_append(fig, "text ", box_b[0], box_b[1], box_b[2], box_b[3], color, " B");
 	}
-	return fig;
 }
 
 void DetectorZoneState::reset()
@@ -280,29 +839,36 @@ void DetectorZoneState::reset()
 }
 
 void DetectorZoneState::update(
-	std::vector<ResultTarget> &objects, const DetectorZoneParams &zone_params)
+	const std::vector<ResultTarget> &objects, const DetectorZoneParams &zone_params)
 {
 	reset();
 	bool is_border = (zone_params.type == "border" || zone_params.type == "border_swapped");
+	const bool is_compiled = zone_params.compiled();
 
 	for (size_t tg_ind = 0; tg_ind < objects.size(); ++tg_ind)
 	{
-		ResultTarget &object = objects[tg_ind];
-		bool inside = zone_params.is_inside(object.center_x, object.center_y);
+		const ResultTarget &object = objects[tg_ind];
+		bool inside = zone_params.is_inside(object.center_x, object.center_y, is_compiled);
 		if (inside)
 		{
 			objects_in_zone[object.id] = true;
 			limits_update(object);
 		}
 
-		if (object.track.points.size() < 2 || object.track.points.back().processed)
+		const ResultTrack::points_t &points = object.track.points;
+		if (points.size() < 2)
 			continue;
+		ResultTrack::Point &watermark = watermarks[object.id];
+		const size_t first = std::max<size_t>(object.track.unseen_from(watermark), 1);
+		watermark = points.back();
 
-		ResultTrack::points_t::reverse_iterator cur_pt = object.track.points.rbegin();
-		ResultTrack::points_t::reverse_iterator prev_pt = cur_pt++;
-		while (prev_pt != object.track.points.rend() && !cur_pt->processed)
+		//segments ending at a point after the watermark, newest first
+		for (size_t i = points.size() - 1; i >= first; --i)
 		{
-			int cross = zone_params.check_borders(prev_pt->x, prev_pt->y, cur_pt->x, cur_pt->y);
+			const ResultTrack::Point &prev_pt = points[i];
+			const ResultTrack::Point &cur_pt = points[i - 1];
+			int cross = zone_params.check_borders(prev_pt.x, prev_pt.y, cur_pt.x, cur_pt.y,
+				is_compiled);
 			if (!cross)
 				continue;
 
@@ -321,21 +887,20 @@ void DetectorZoneState::update(
 				else
 					leavings[object.id] = true;
 			}
-
-			cur_pt->processed = true;
-			++prev_pt;
-			++cur_pt;
 		} //for each track point
 	} //for each object
 
 	//remove lost objects
-	std::set<int> existing;
+	existing.clear();
 	for (size_t i = 0; i < objects.size(); ++i)
-		existing.insert(objects[i].id);
+		existing[objects[i].id] = true;
 	container_sanitize(cross_AB, existing);
 	container_sanitize(cross_BA, existing);
 	container_sanitize(enters, existing);
 	container_sanitize(leavings, existing);
+	watermarks.erase_if([this](const IdMap<ResultTrack::Point>::value_type &obj) {
+		return !existing.count(obj.first);
+	});
 }
 
 void DetectorZoneState::limits_update(const ResultTarget &obj)
@@ -358,17 +923,11 @@ void DetectorZoneState::limits_update(const ResultTarget &obj)
 		track_len = obj.track.path_len;
 }
 
-void DetectorZoneState::container_sanitize(obj_t &container, const std::set<int> existing_ids)
+void DetectorZoneState::container_sanitize(obj_t &container, const obj_t &existing_ids)
 {
-	std::set<int> victims;
-	for (obj_t::iterator it = container.begin(); it != container.end(); ++it)
-	{
-		if (existing_ids.find(it->first) == existing_ids.end())
-			victims.insert(it->first);
-	}
-
-	for (std::set<int>::const_iterator it1 = victims.begin(); it1 != victims.end(); ++it1)
-		container.erase(*it1);
+	container.erase_if([&existing_ids](const obj_t::value_type &obj) {
+		return !existing_ids.count(obj.first);
+	});
 }
 
 }  // namespace anfisa
@@ -1,14 +1,15 @@
 #ifndef ANFISA_IO_STRUCTURES_H
 #define ANFISA_IO_STRUCTURES_H
 
+#include "id-map.hpp"
+#include "raw-structures.hpp"
+#include "ring-buffer.hpp"
+
 #include <opencv2/core/core.hpp>
 
 #include <stdint.h>
-#include <list>
 #include <vector>
 #include <string>
-#include <set>
-#include <map>
 
 namespace anfisa {
 
@@ -27,6 +28,7 @@ struct ResultDetection
 	ResultDetection();
 	cv::Rect rect(int frame_w = 100, int frame_h = 100, int margin_w = 0, int margin_h = 0) const;
 	void set_rect(const cv::Rect &rect, int frame_w, int frame_h);
+	void set_raw(const DetectionRaw &det, int frame_w, int frame_h);
 
 	float center_x;
 	float center_y;
@@ -41,25 +43,57 @@ struct ResultDetection
 	std::vector<uint64_t> fingerprint;
 };
 
+void raw_to_results(const std::vector<DetectionRaw> &raw, int frame_w, int frame_h,
+	std::vector<ResultDetection> &results);
+
+// Track history, oldest point first.
+// Points live in a ring buffer of at most `capacity` points; push_back()
+// on a full track either drops every second point of the older half
+// (decimate, the default: the whole track keeps its shape at a coarser
+// step) or the oldest point. path_len is the length of the whole path,
+// dropped points included, and is kept up to date by push_back().
+// push_back() also numbers the points: zone states and the stream writer
+// remember the newest point they have seen per object and take only the
+// points after it (unseen_from()). Points appended to `points` directly are
+// not numbered and such a track is taken whole every time; a track that
+// restarts numbering (a new track under a reused id) is taken whole once.
 struct ResultTrack
 {
-	ResultTrack() : path_len(0) {}
+	static const size_t DEFAULT_CAPACITY;
+
+	ResultTrack() : points(DEFAULT_CAPACITY), path_len(0), decimate(true), next_seq(1) {}
 
 	struct Point
 	{
 		float x;
 		float y;
 		uint64_t ts;
-		bool processed;
+		//set by ResultTrack::push_back(), increasing along the track, 0 if
+		//not numbered
+		uint32_t seq;
 
+		Point() : x(0), y(0), ts(0), seq(0) {}
 		Point(float x_, float y_, uint64_t ts_)
-			: x(x_), y(y_), ts(ts_), processed(false)
+			: x(x_), y(y_), ts(ts_), seq(0)
 		{ }
 	};
 
-	typedef std::list<Point> points_t;
+	typedef RingBuffer<Point> points_t;
+
+	void push_back(const Point &pt);
+	//keeps the newest points
+	void set_capacity(size_t capacity) { points.set_capacity(capacity); }
+	void clear();
+	//index of the first point after seen, the newest point a consumer took
+	//from this track before (seq 0 if none); 0 if the points are not
+	//numbered or seen is not a point of this track any more (newer than the
+	//newest point, or another point under its seq)
+	size_t unseen_from(const Point &seen) const;
+
 	points_t points;
 	float path_len;
+	bool decimate;
+	uint32_t next_seq;
 };
 
 struct ResultTarget : public ResultDetection
@@ -81,13 +115,51 @@ struct ResultTarget : public ResultDetection
 		const std::string &color_track = "",
 		const std::string &color_shape = "",
 		const std::string &color_velocity = "") const;
+	//same text appended to fig, a buffer reused between frames does not allocate
+	void append_figures_text(std::string &fig,
+		const std::string &color_rect = "",
+		const std::string &color_track = "",
+		const std::string &color_shape = "",
+		const std::string &color_velocity = "") const;
 };
 
+//figures of all targets of a frame, as the concatenated render_figures_text()
+void append_figures_text(std::string &fig, const std::vector<ResultTarget> &targets,
+	const std::string &color_rect = "",
+	const std::string &color_track = "",
+	const std::string &color_shape = "",
+	const std::string &color_velocity = "");
+
+// Sensitivity grid over the image.
+// Pixel (x, y) takes the value of cell grid_w * (grid_h * y / image_h) +
+// grid_w * x / image_w of mask_string, so every cell is a rectangle of
+// pixels and render() fills it row by row. update() refills only the cells
+// whose mask_string value changed since the last render. With packed set
+// the mask is kept as mask_bits instead, one bit per pixel (set where the
+// cell value is not 0), bits_stride bytes per row, bit x & 7 of byte x / 8;
+// lookup() needs no mask at all.
 struct DetectorZoneGrid
 {
 	DetectorZoneGrid()
-		: is_valid(false), grid_w(0), grid_h(0), image_w(0), image_h(0) {}
+		: is_valid(false), grid_w(0), grid_h(0), image_w(0), image_h(0), packed(false),
+		  bits_stride(0), rendered_w(0), rendered_h(0), rendered_image_w(0),
+		  rendered_image_h(0), rendered_packed(false) {}
 	void render();
+	//render the changed cells (everything if the sizes changed), return their number
+	int update();
+
+	//the mask value of pixel (x, y), straight from the grid; 0 outside the
+	//image and when the sizes or mask_string do not make a grid
+	uint8_t lookup(int x, int y) const
+	{
+		if (x < 0 || y < 0 || x >= image_w || y >= image_h || grid_w <= 0 || grid_h <= 0 ||
+			mask_string.size() < size_t(grid_w) * size_t(grid_h))
+		{
+			return 0;
+		}
+		return mask_string[grid_w * int(int64_t(grid_h) * y / image_h) +
+			int(int64_t(grid_w) * x / image_w)];
+	}
 
 	bool is_valid;
 	int sensitivity;
@@ -95,19 +167,127 @@ struct DetectorZoneGrid
 	int grid_h;
 	int image_w;
 	int image_h;
+	bool packed;
 	std::vector<uint8_t> mask_string;
 	std::vector<uint8_t> mask;
+	std::vector<uint8_t> mask_bits;
+	int bits_stride;
+
+private:
+	void fill_cell(int cx, int cy);
+
+	//first pixel column of every grid column, then image_w; same for rows
+	std::vector<int> col_start;
+	std::vector<int> row_start;
+	//mask_string and sizes of the last render
+	std::vector<uint8_t> rendered;
+	int rendered_w;
+	int rendered_h;
+	int rendered_image_w;
+	int rendered_image_h;
+	bool rendered_packed;
+};
+
+enum ZONE_TYPE
+{
+	ZONE_TYPE_UNKNOWN = 0,
+	ZONE_TYPE_LOOKUP,
+	ZONE_TYPE_IGNORE,
+	ZONE_TYPE_BORDER,
+	ZONE_TYPE_BORDER_SWAPPED
+};
+
+int zone_type_from_string(const std::string &type);
+
+// Zone polygon prepared for point tests.
+// Vertices are truncated to int like the cv::Point contour is_inside()
+// passes to cv::pointPolygonTest(), and inside() gives the same answer:
+// distinct vertex y split the plane into horizontal slabs, a point inside
+// a slab is tested only against the edges spanning the slab (binary search
+// plus a few edges), a point on a vertex y uses the full edge loop.
+struct DetectorZoneIndex
+{
+	DetectorZoneIndex()
+		: valid(false), type(ZONE_TYPE_UNKNOWN), min_x(0), min_y(0), max_x(0), max_y(0) {}
+	void build(const std::string &zone_type, const std::vector<double> &points);
+	//pointPolygonTest(...) >= 0
+	bool inside(float x, float y) const;
+	bool inside_full(float x, float y) const;
+
+	bool valid;
+	int type;
+	std::vector<cv::Point2f> vertices;
+	float min_x;
+	float min_y;
+	float max_x;
+	float max_y;
+	//sorted distinct vertex y, slab k is (slab_y[k], slab_y[k + 1])
+	std::vector<float> slab_y;
+	//edges spanning slab k are slab_edges[slab_start[k] .. slab_start[k + 1]),
+	//edge i goes from vertex i - 1 (cyclic) to vertex i
+	std::vector<int> slab_start;
+	std::vector<int> slab_edges;
+};
+
+// Zone borders prepared for track segment tests.
+// Edges are kept as float segment arrays in the order check_borders() walks
+// them, with the type decoded once; cross() evaluates the same float expression
+// and the lowest crossed edge gives the direction. Every edge is tested:
+// exactly collinear edges pass the test anywhere on the segment line, so
+// skipping far edges by a grid or box would change the result.
+struct DetectorZoneBorders
+{
+	DetectorZoneBorders() : valid(false), type(ZONE_TYPE_UNKNOWN), edge_count(0) {}
+	void build(const std::string &zone_type, const std::vector<double> &points);
+	//0 if not crossing, direction otherwise, edge gets the crossed edge index
+	int cross(float obj_x0, float obj_y0, float obj_x1, float obj_y1, int *edge = 0) const;
+	//segments are 4 floats each (x0 y0 x1 y1), directions[i] as cross();
+	//return the first crossing segment or -1
+	int cross(const float *segments, int count, int *directions) const;
+
+	bool valid;
+	int type;
+	int edge_count;
+	//edge i goes from (x1[i], y1[i]) to (x2[i], y2[i]), dx = x2 - x1, dy = y2 - y1
+	std::vector<float> x1;
+	std::vector<float> y1;
+	std::vector<float> x2;
+	std::vector<float> y2;
+	std::vector<float> dx;
+	std::vector<float> dy;
+
+private:
+	void add_edge(double edge_x1, double edge_y1, double edge_x2, double edge_y2);
+	bool edge_cross(int i, float obj_x0, float obj_y0, float obj_x1, float obj_y1) const;
 };
 
 struct DetectorZoneParams
 {
 	DetectorZoneParams();
 
+	//prepare index for is_inside() and borders for check_borders(); after
+	//type or points change both use the raw points again until the next
+	//compile()
+	void compile();
+	//index and borders are built from the current type and points
+	bool compiled() const;
+
 	bool is_inside(float obj_x, float obj_y) const;
 
 	//return 0 if not crossing, direction otherwise
 	int check_borders(float obj_x0, float obj_y0, float obj_x1, float obj_y1) const;
+
+	//same with compiled() evaluated by the caller, once per frame rather
+	//than once per query (it compares all points)
+	bool is_inside(float obj_x, float obj_y, bool is_compiled) const;
+	int check_borders(float obj_x0, float obj_y0, float obj_x1, float obj_y1,
+		bool is_compiled) const;
 	std::string render_figures_text(const std::string &color) const;
+	void append_figures_text(std::string &fig, const std::string &color) const;
+	//number of point values drawn as the outline: even, capped, 0 if none
+	int outline_size() const;
+	//boxes (left top right bottom) of the A and B labels of a border zone
+	bool label_boxes(double *box_a, double *box_b) const;
 
 	static const int MAX_POINTS;
 
@@ -128,20 +308,29 @@ struct DetectorZoneParams
 	double max_obj_size;
 	double max_obj_speed;
 	double max_obj_track_len;
+
+	DetectorZoneIndex index;
+	DetectorZoneBorders borders;
+	//type and points of the last compile()
+	std::string compiled_type;
+	std::vector<double> compiled_points;
 };
 
 struct DetectorZoneState
 {
 	DetectorZoneState() { reset(); }
-	void update(std::vector<ResultTarget> &objects, const DetectorZoneParams &zone_params);
-
-	//pairs of (object_id, is_new)
-	typedef std::map<int, bool> obj_t;
-	std::map<int, bool> cross_AB;
-	std::map<int, bool> cross_BA;
-	std::map<int, bool> enters;
-	std::map<int, bool> leavings;
-	std::map<int, bool> objects_in_zone;
+	//track segments after the watermark of their object are tested for
+	//crossings, so every segment is tested once per zone (see
+	//ResultTrack::unseen_from() for unnumbered and restarted tracks)
+	void update(const std::vector<ResultTarget> &objects, const DetectorZoneParams &zone_params);
+
+	//pairs of (object_id, is_new), in no particular order
+	typedef IdMap<bool> obj_t;
+	obj_t cross_AB;
+	obj_t cross_BA;
+	obj_t enters;
+	obj_t leavings;
+	obj_t objects_in_zone;
 
 	double size_w;
 	double size_h;
@@ -155,7 +344,13 @@ struct DetectorZoneState
 
 	void reset();
 	void limits_update(const ResultTarget &obj);
-	void container_sanitize(obj_t &container, const std::set<int> existing_ids);
+	//erase ids not in existing_ids
+	void container_sanitize(obj_t &container, const obj_t &existing_ids);
+
+	//ids of the objects passed to the last update()
+	obj_t existing;
+	//object_id -> newest track point tested
+	IdMap<ResultTrack::Point> watermarks;
 };
 
 }  // namespace anfisa
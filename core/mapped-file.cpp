@@ -0,0 +1,89 @@
+#include "mapped-file.hpp"
+
+#ifdef _WIN32
+#include <cstdio>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace anfisa {
+
+#ifdef _WIN32
+
+std::shared_ptr<char> map_file(const std::string &path, size_t &size)
+{
+	//no mmap here: read the file into one block
+	size = 0;
+	FILE *file = fopen(path.c_str(), "rb");
+	if (!file)
+		return std::shared_ptr<char>();
+
+	fseek(file, 0, SEEK_END);
+	long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	if (len <= 0)
+	{
+		fclose(file);
+		return std::shared_ptr<char>();
+	}
+
+	std::shared_ptr<char> data(new char[len], std::default_delete<char[]>());
+	size_t res = fread(data.get(), 1, len, file);
+	fclose(file);
+	if (res != (size_t)len)
+		return std::shared_ptr<char>();
+
+	size = len;
+	return data;
+}
+
+#else
+
+struct MappedFileDeleter
+{
+	MappedFileDeleter(size_t len) : size(len) {}
+	void operator()(char *ptr) const { munmap(ptr, size); }
+	size_t size;
+};
+
+std::shared_ptr<char> map_file(const std::string &path, size_t &size)
+{
+	size = 0;
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return std::shared_ptr<char>();
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size <= 0)
+	{
+		close(fd);
+		return std::shared_ptr<char>();
+	}
+
+	void *ptr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return std::shared_ptr<char>();
+
+	size = st.st_size;
+	return std::shared_ptr<char>((char *)ptr, MappedFileDeleter(size));
+}
+
+#endif
+
+uint32_t checksum_words(const void *data, size_t words)
+{
+	const uint32_t *ptr = (const uint32_t *)data;
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < words; ++i)
+	{
+		hash ^= ptr[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+}  // namespace anfisa
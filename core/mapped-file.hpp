@@ -0,0 +1,21 @@
+#ifndef ANFISA_MAPPED_FILE_H
+#define ANFISA_MAPPED_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+namespace anfisa {
+
+// Read-only mapping of a whole file.
+// The mapping is released with the last copy of the returned pointer;
+// empty pointer if the file cannot be mapped or is empty.
+std::shared_ptr<char> map_file(const std::string &path, size_t &size);
+
+//FNV-1a over 32-bit words, for integrity checks of binary models
+uint32_t checksum_words(const void *data, size_t words);
+
+}  // namespace anfisa
+
+#endif  // ANFISA_MAPPED_FILE_H
@@ -0,0 +1,309 @@
+#include "overlay.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace anfisa {
+
+//strokes of the zone labels in a unit box, y down, 4 values per stroke
+static const float GLYPH_A[] = {
+	0.0f, 1.0f, 0.5f, 0.0f,
+	0.5f, 0.0f, 1.0f, 1.0f,
+	0.2f, 0.6f, 0.8f, 0.6f
+};
+
+static const float GLYPH_B[] = {
+	0.0f, 0.0f, 0.0f, 1.0f,
+	0.0f, 0.0f, 0.7f, 0.0f,
+	0.7f, 0.0f, 0.9f, 0.2f,
+	0.9f, 0.2f, 0.7f, 0.45f,
+	0.7f, 0.45f, 0.0f, 0.45f,
+	0.7f, 0.45f, 1.0f, 0.7f,
+	1.0f, 0.7f, 0.7f, 1.0f,
+	0.7f, 1.0f, 0.0f, 1.0f
+};
+
+static uint8_t overlay_channel(double v)
+{
+	if (!(v > 0))
+		return 0;
+	if (v >= 255)
+		return 255;
+	return uint8_t(v + 0.5);
+}
+
+//floor(a / b), b > 0
+static int64_t floor_div(int64_t a, int64_t b)
+{
+	int64_t q = a / b;
+	if (a % b && a < 0)
+		--q;
+	return q;
+}
+
+//Liang-Barsky: clip the segment to [left, right] x [top, bottom], false if outside
+static bool clip_segment(double &x0, double &y0, double &x1, double &y1,
+	double left, double top, double right, double bottom)
+{
+	const double dx = x1 - x0;
+	const double dy = y1 - y0;
+	const double p[4] = {-dx, dx, -dy, dy};
+	const double q[4] = {x0 - left, right - x0, y0 - top, bottom - y0};
+	double t0 = 0;
+	double t1 = 1;
+	for (int i = 0; i < 4; ++i)
+	{
+		if (p[i] == 0)
+		{
+			if (q[i] < 0)
+				return false;
+			continue;
+		}
+		const double t = q[i] / p[i];
+		if (p[i] < 0)
+			t0 = std::max(t0, t);
+		else
+			t1 = std::min(t1, t);
+		if (t0 > t1)
+			return false;
+	}
+
+	const double sx = x0;
+	const double sy = y0;
+	x0 = sx + t0 * dx;
+	y0 = sy + t0 * dy;
+	x1 = sx + t1 * dx;
+	y1 = sy + t1 * dy;
+	return true;
+}
+
+void OverlayRenderer::add_line(double x0, double y0, double x1, double y1, const cv::Scalar &color)
+{
+	Line line;
+	line.x0 = float(x0);
+	line.y0 = float(y0);
+	line.x1 = float(x1);
+	line.y1 = float(y1);
+	for (int c = 0; c < 4; ++c)
+		line.color[c] = overlay_channel(color.val[c]);
+	lines.push_back(line);
+}
+
+void OverlayRenderer::add(const ResultTarget &target,
+	const OverlayColor &color_rect,
+	const OverlayColor &color_track,
+	const OverlayColor &color_shape,
+	const OverlayColor &color_velocity)
+{
+	if (color_rect.enabled)
+	{
+		const float left = target.center_x - target.width / 2;
+		const float top = target.center_y - target.height / 2;
+		const float right = target.center_x + target.width / 2;
+		const float bottom = target.center_y + target.height / 2;
+		add_line(left, top, right, top, color_rect.color);
+		add_line(right, top, right, bottom, color_rect.color);
+		add_line(right, bottom, left, bottom, color_rect.color);
+		add_line(left, bottom, left, top, color_rect.color);
+	}
+	if (color_track.enabled && target.track.points.size() > 2)
+	{
+		const ResultTrack::points_t &points = target.track.points;
+		const size_t n = points.size();
+		for (size_t j = 0; j + 1 < n; ++j)
+			add_line(points[j].x, points[j].y, points[j + 1].x, points[j + 1].y, color_track.color);
+		add_line(points[n - 1].x, points[n - 1].y, target.center_x, target.center_y,
+			color_track.color);
+	}
+	if (color_shape.enabled && target.shape.size() > 2)
+	{
+		const std::vector<cv::Point2f> &shape = target.shape;
+		for (size_t j = 0; j < shape.size() - 1; ++j)
+			add_line(shape[j].x, shape[j].y, shape[j + 1].x, shape[j + 1].y, color_shape.color);
+		add_line(shape[0].x, shape[0].y, shape.back().x, shape.back().y, color_shape.color);
+	}
+	if (color_velocity.enabled)
+	{
+		add_line(target.center_x, target.center_y,
+			target.center_x + 30 * target.speed_x,
+			target.center_y + 30 * target.speed_y,
+			color_velocity.color);
+	}
+}
+
+void OverlayRenderer::add(const std::vector<ResultTarget> &targets,
+	const OverlayColor &color_rect,
+	const OverlayColor &color_track,
+	const OverlayColor &color_shape,
+	const OverlayColor &color_velocity)
+{
+	for (size_t i = 0; i < targets.size(); ++i)
+		add(targets[i], color_rect, color_track, color_shape, color_velocity);
+}
+
+void OverlayRenderer::add(const DetectorZoneParams &zone, const OverlayColor &color)
+{
+	const int size = zone.outline_size();
+	if (!color.enabled || !size)
+		return;
+
+	const std::vector<double> &points = zone.points;
+	for (int j = 0; j < size / 2 - 1; ++j)
+	{
+		add_line(points[2 * j], points[2 * j + 1], points[2 * j + 2], points[2 * j + 3],
+			color.color);
+	}
+
+	double box_a[4];
+	double box_b[4];
+	if (zone.type != "border")
+	{
+		add_line(points[size - 2], points[size - 1], points[0], points[1], color.color);
+	}
+	else if (zone.label_boxes(box_a, box_b))
+	{
+		add_glyph('A', box_a, color.color);
+		add_glyph('B', box_b, color.color);
+	}
+}
+
+void OverlayRenderer::add_glyph(char glyph, const double *box, const cv::Scalar &color)
+{
+	const float *strokes = glyph == 'A' ? GLYPH_A : GLYPH_B;
+	const int count = glyph == 'A' ? sizeof(GLYPH_A) / sizeof(float) : sizeof(GLYPH_B) / sizeof(float);
+	const double w = box[2] - box[0];
+	const double h = box[3] - box[1];
+	for (int i = 0; i < count; i += 4)
+	{
+		add_line(box[0] + w * strokes[i], box[1] + h * strokes[i + 1],
+			box[0] + w * strokes[i + 2], box[1] + h * strokes[i + 3], color);
+	}
+}
+
+bool OverlayRenderer::render(cv::Mat &frame, TaskPool *pool)
+{
+	const int cn = frame.channels();
+	if (frame.empty() || frame.depth() != CV_8U || cn > 4)
+		return false;
+
+	//to pixels, clipped a little outside of the frame so that the pixels
+	//of a clipped line near the frame are those of the whole line
+	const double sx = frame.cols / 100.0;
+	const double sy = frame.rows / 100.0;
+	pixel_lines.clear();
+	for (size_t i = 0; i < lines.size(); ++i)
+	{
+		const Line &line = lines[i];
+		double x0 = line.x0 * sx;
+		double y0 = line.y0 * sy;
+		double x1 = line.x1 * sx;
+		double y1 = line.y1 * sy;
+		if (!std::isfinite(x0) || !std::isfinite(y0) || !std::isfinite(x1) || !std::isfinite(y1))
+			continue;
+		if (!clip_segment(x0, y0, x1, y1, -2, -2, frame.cols + 1, frame.rows + 1))
+			continue;
+
+		PixelLine px;
+		px.x0 = (int)floor(x0 + 0.5);
+		px.y0 = (int)floor(y0 + 0.5);
+		px.x1 = (int)floor(x1 + 0.5);
+		px.y1 = (int)floor(y1 + 0.5);
+		//the major axis goes up
+		const bool y_major = std::abs(px.y1 - px.y0) >= std::abs(px.x1 - px.x0);
+		if (y_major ? px.y1 < px.y0 : px.x1 < px.x0)
+		{
+			std::swap(px.x0, px.x1);
+			std::swap(px.y0, px.y1);
+		}
+		px.top = std::min(px.y0, px.y1);
+		px.bottom = std::max(px.y0, px.y1);
+		if (px.bottom < 0 || px.top >= frame.rows)
+			continue;
+		px.line = (int)i;
+		pixel_lines.push_back(px);
+	}
+
+	row_ptrs.resize(frame.rows);
+	for (int y = 0; y < frame.rows; ++y)
+		row_ptrs[y] = frame.ptr<uint8_t>(y);
+
+	//a few bands per thread for balance, not thinner than band_rows
+	int bands = 1;
+	if (pool && pool->size() > 1)
+	{
+		const int parts = 4 * pool->size();
+		const int rows = std::max(std::max(band_rows, 1), (frame.rows + parts - 1) / parts);
+		bands = (frame.rows + rows - 1) / rows;
+	}
+	if (bands == 1)
+	{
+		draw_band(frame, 0, frame.rows);
+		return true;
+	}
+
+	const int rows = (frame.rows + bands - 1) / bands;
+	cv::Mat *target = &frame;
+	for (int b = 0; b < bands; ++b)
+	{
+		const int top = b * rows;
+		const int bottom = std::min(frame.rows, top + rows);
+		pool->push([this, target, top, bottom](int) { draw_band(*target, top, bottom); });
+	}
+	pool->wait();
+	return true;
+}
+
+void OverlayRenderer::draw_band(cv::Mat &frame, int top, int bottom) const
+{
+	const int cn = frame.channels();
+	const int cols = frame.cols;
+	for (size_t i = 0; i < pixel_lines.size(); ++i)
+	{
+		const PixelLine &px = pixel_lines[i];
+		if (px.bottom < top || px.top >= bottom)
+			continue;
+
+		const uint8_t *color = lines[px.line].color;
+		const int64_t dx = px.x1 - px.x0;
+		const int64_t dy = px.y1 - px.y0;
+		if (std::abs(dy) >= std::abs(dx) && dy)
+		{
+			//dy > 0, one pixel per row, x rounded to nearest
+			const int y_begin = std::max(px.y0, top);
+			const int y_end = std::min(px.y1 + 1, bottom);
+			for (int y = y_begin; y < y_end; ++y)
+			{
+				const int x = px.x0 + (int)floor_div(2 * (y - px.y0) * dx + dy, 2 * dy);
+				if (x < 0 || x >= cols)
+					continue;
+				uint8_t *p = row_ptrs[y] + x * cn;
+				for (int c = 0; c < cn; ++c)
+					p[c] = color[c];
+			}
+			continue;
+		}
+
+		//dx >= 0, one pixel per column; only the columns near the band
+		int x_begin = std::max(px.x0, 0);
+		int x_end = std::min(px.x1 + 1, cols);
+		if (dy)
+		{
+			const double xa = px.x0 + (top - 0.5 - px.y0) * double(dx) / dy;
+			const double xb = px.x0 + (bottom - 0.5 - px.y0) * double(dx) / dy;
+			x_begin = std::max(x_begin, (int)floor(std::min(xa, xb)) - 1);
+			x_end = std::min(x_end, (int)ceil(std::max(xa, xb)) + 2);
+		}
+		for (int x = x_begin; x < x_end; ++x)
+		{
+			const int y = dx ? px.y0 + (int)floor_div(2 * (x - px.x0) * dy + dx, 2 * dx) : px.y0;
+			if (y < top || y >= bottom)
+				continue;
+			uint8_t *p = row_ptrs[y] + x * cn;
+			for (int c = 0; c < cn; ++c)
+				p[c] = color[c];
+		}
+	}
+}
+
+}  // namespace anfisa
@@ -0,0 +1,92 @@
+#ifndef ANFISA_OVERLAY_H
+#define ANFISA_OVERLAY_H
+
+#include "io-structures.hpp"
+#include "task-pool.hpp"
+
+#include <opencv2/core/core.hpp>
+
+#include <stdint.h>
+#include <vector>
+
+namespace anfisa {
+
+// Color of one figure kind, a disabled kind is not drawn
+// (the empty color string of render_figures_text()).
+struct OverlayColor
+{
+	OverlayColor() : enabled(false) {}
+	OverlayColor(const cv::Scalar &color_) : enabled(true), color(color_) {}
+
+	bool enabled;
+	cv::Scalar color;
+};
+
+// Draws the figures of render_figures_text() straight into a frame.
+// add() collects the lines of targets and zones in percent coordinates
+// (zone labels are stroked A/B glyphs in their text boxes), render() maps
+// them to pixels once, clips them to the frame and draws one pixel wide
+// lines, later figures over earlier ones. With a pool the frame is split
+// into horizontal bands drawn in parallel; every pixel of a line depends
+// only on the line, so the result is the same with any band split.
+class OverlayRenderer
+{
+public:
+	OverlayRenderer() : band_rows(64) {}
+
+	void clear() { lines.clear(); }
+
+	void add(const ResultTarget &target,
+		const OverlayColor &color_rect = OverlayColor(),
+		const OverlayColor &color_track = OverlayColor(),
+		const OverlayColor &color_shape = OverlayColor(),
+		const OverlayColor &color_velocity = OverlayColor());
+	void add(const std::vector<ResultTarget> &targets,
+		const OverlayColor &color_rect = OverlayColor(),
+		const OverlayColor &color_track = OverlayColor(),
+		const OverlayColor &color_shape = OverlayColor(),
+		const OverlayColor &color_velocity = OverlayColor());
+	void add(const DetectorZoneParams &zone, const OverlayColor &color);
+	//line from (x0, y0) to (x1, y1) in percent of the frame
+	void add_line(double x0, double y0, double x1, double y1, const cv::Scalar &color);
+
+	//false if frame is not 8-bit with 1 to 4 channels
+	bool render(cv::Mat &frame, TaskPool *pool = 0);
+
+	//minimal band height of the parallel render
+	int band_rows;
+
+private:
+	struct Line
+	{
+		float x0;
+		float y0;
+		float x1;
+		float y1;
+		uint8_t color[4];
+	};
+
+	struct PixelLine
+	{
+		int x0;
+		int y0;
+		int x1;
+		int y1;
+		int top;
+		int bottom;
+		int line;
+	};
+
+	void add_glyph(char glyph, const double *box, const cv::Scalar &color);
+	void draw_band(cv::Mat &frame, int top, int bottom) const;
+
+	std::vector<Line> lines;
+	//lines of the last render() clipped and in pixels
+	std::vector<PixelLine> pixel_lines;
+	//frame rows of the last render()
+	std::vector<uint8_t *> row_ptrs;
+};
+
+}  // namespace anfisa
+
+#endif  // ANFISA_OVERLAY_H
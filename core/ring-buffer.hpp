@@ -0,0 +1,161 @@
+#ifndef ANFISA_RING_BUFFER_H
+#define ANFISA_RING_BUFFER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+namespace anfisa {
+
+// Bounded FIFO in one contiguous block.
+// push_back() on a full buffer overwrites the oldest element, pop_front()
+// and pop_back() are O(1), [0] is the oldest element. Storage grows with
+// the element count up to capacity(), so short buffers stay small and a
+// copy copies only the slots used so far.
+template <typename T>
+class RingBuffer
+{
+public:
+	template <typename B, typename V>
+	class iterator_t
+	{
+	public:
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef V value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef V *pointer;
+		typedef V &reference;
+
+		iterator_t() : buf(0), pos(0) {}
+		iterator_t(B *buf_, size_t pos_) : buf(buf_), pos(pos_) {}
+
+		operator iterator_t<const RingBuffer, const T>() const
+		{
+			return iterator_t<const RingBuffer, const T>(buf, pos);
+		}
+
+		V &operator*() const { return (*buf)[pos]; }
+		V *operator->() const { return &(*buf)[pos]; }
+		V &operator[](difference_type n) const { return (*buf)[pos + n]; }
+
+		iterator_t &operator++() { ++pos; return *this; }
+		iterator_t &operator--() { --pos; return *this; }
+		iterator_t operator++(int) { iterator_t it = *this; ++pos; return it; }
+		iterator_t operator--(int) { iterator_t it = *this; --pos; return it; }
+		iterator_t &operator+=(difference_type n) { pos += n; return *this; }
+		iterator_t &operator-=(difference_type n) { pos -= n; return *this; }
+		iterator_t operator+(difference_type n) const { return iterator_t(buf, pos + n); }
+		iterator_t operator-(difference_type n) const { return iterator_t(buf, pos - n); }
+		difference_type operator-(const iterator_t &other) const
+		{
+			return difference_type(pos) - difference_type(other.pos);
+		}
+
+		bool operator==(const iterator_t &other) const { return pos == other.pos; }
+		bool operator!=(const iterator_t &other) const { return pos != other.pos; }
+		bool operator<(const iterator_t &other) const { return pos < other.pos; }
+		bool operator>(const iterator_t &other) const { return pos > other.pos; }
+		bool operator<=(const iterator_t &other) const { return pos <= other.pos; }
+		bool operator>=(const iterator_t &other) const { return pos >= other.pos; }
+
+	private:
+		B *buf;
+		size_t pos;
+	};
+
+	typedef T value_type;
+	typedef iterator_t<RingBuffer, T> iterator;
+	typedef iterator_t<const RingBuffer, const T> const_iterator;
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+	explicit RingBuffer(size_t capacity = 0) : cap(capacity), head(0), count(0) {}
+
+	size_t size() const { return count; }
+	bool empty() const { return !count; }
+	bool full() const { return count == cap; }
+	size_t capacity() const { return cap; }
+
+	//keep the newest min(size(), capacity) elements
+	void set_capacity(size_t capacity)
+	{
+		const size_t keep = std::min(count, capacity);
+		std::vector<T> kept;
+		kept.reserve(keep);
+		for (size_t i = count - keep; i < count; ++i)
+			kept.push_back((*this)[i]);
+		items.swap(kept);
+		cap = capacity;
+		head = 0;
+		count = keep;
+	}
+
+	void clear()
+	{
+		head = 0;
+		count = 0;
+	}
+
+	T &operator[](size_t i) { return items[wrap(head + i)]; }
+	const T &operator[](size_t i) const { return items[wrap(head + i)]; }
+	T &front() { return items[head]; }
+	const T &front() const { return items[head]; }
+	T &back() { return (*this)[count - 1]; }
+	const T &back() const { return (*this)[count - 1]; }
+
+	void push_back(const T &item)
+	{
+		if (!cap)
+			return;
+		if (count == cap)
+		{
+			items[head] = item;
+			head = wrap(head + 1);
+			return;
+		}
+
+		//until the first wrap the used slots end at items.size()
+		const size_t pos = wrap(head + count);
+		if (pos == items.size())
+		{
+			if (items.size() == items.capacity())
+				items.reserve(std::min(cap, std::max<size_t>(8, 2 * items.size())));
+			items.push_back(item);
+		}
+		else
+		{
+			items[pos] = item;
+		}
+		++count;
+	}
+
+	void pop_front()
+	{
+		head = wrap(head + 1);
+		--count;
+	}
+
+	void pop_back() { --count; }
+
+	iterator begin() { return iterator(this, 0); }
+	iterator end() { return iterator(this, count); }
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, count); }
+	reverse_iterator rbegin() { return reverse_iterator(end()); }
+	reverse_iterator rend() { return reverse_iterator(begin()); }
+	const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+	const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+private:
+	size_t wrap(size_t i) const { return i >= cap ? i - cap : i; }
+
+	std::vector<T> items;
+	size_t cap;
+	size_t head;
+	size_t count;
+};
+
+}  // namespace anfisa
+
+#endif  // ANFISA_RING_BUFFER_H
@@ -0,0 +1,547 @@
+#include "serialization.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace anfisa {
+
+static const char RESULT_STREAM_MAGIC[4] = {'A', 'R', 'E', 'S'};
+static const uint32_t RESULT_STREAM_VERSION = 1;
+//magic, version, flags, count, size, ts
+static const size_t RESULT_STREAM_HEADER = 28;
+
+enum RESULT_RECORD_FLAGS
+{
+	RECORD_READY = 0x1,
+	RECORD_LABEL = 0x2,
+	RECORD_FINGERPRINT = 0x4,
+	RECORD_ICON = 0x8,
+	RECORD_SHAPE = 0x10,
+	RECORD_TRACK = 0x20,
+	RECORD_TRACK_DELTA = 0x40
+};
+
+static inline void put_u32(std::vector<uint8_t> &out, uint32_t v)
+{
+	for (int i = 0; i < 4; ++i)
+		out.push_back(uint8_t(v >> (8 * i)));
+}
+
+static inline void put_u64(std::vector<uint8_t> &out, uint64_t v)
+{
+	for (int i = 0; i < 8; ++i)
+		out.push_back(uint8_t(v >> (8 * i)));
+}
+
+static inline void put_float(std::vector<uint8_t> &out, float v)
+{
+	uint32_t u;
+	memcpy(&u, &v, 4);
+	put_u32(out, u);
+}
+
+static inline void put_varint(std::vector<uint8_t> &out, uint64_t v)
+{
+	while (v >= 0x80)
+	{
+		out.push_back(uint8_t(v) | 0x80);
+		v >>= 7;
+	}
+	out.push_back(uint8_t(v));
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+	return (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+	return int64_t(v >> 1) ^ -int64_t(v & 1);
+}
+
+//percent coordinate in 1/256 units, saturated to int16
+static inline int quantize_coord(float v)
+{
+	if (!(v == v))
+		return 0;
+	const float q = v * 256.0f;
+	if (q >= 32767.0f)
+		return 32767;
+	if (q <= -32768.0f)
+		return -32768;
+	return int(lrintf(q));
+}
+
+static inline void put_coord(std::vector<uint8_t> &out, float v, bool quantized)
+{
+	if (!quantized)
+	{
+		put_float(out, v);
+		return;
+	}
+	const uint16_t q = uint16_t(int16_t(quantize_coord(v)));
+	out.push_back(uint8_t(q));
+	out.push_back(uint8_t(q >> 8));
+}
+
+//quantized: zigzag varint delta from the previous point (base for the first)
+static inline void put_point(std::vector<uint8_t> &out, float x, float y, bool quantized,
+	int &base_x, int &base_y)
+{
+	if (!quantized)
+	{
+		put_float(out, x);
+		put_float(out, y);
+		return;
+	}
+	const int qx = quantize_coord(x);
+	const int qy = quantize_coord(y);
+	put_varint(out, zigzag(qx - base_x));
+	put_varint(out, zigzag(qy - base_y));
+	base_x = qx;
+	base_y = qy;
+}
+
+struct ResultCursor
+{
+	ResultCursor(const uint8_t *pos_, const uint8_t *end_) : pos(pos_), end(end_), ok(true) {}
+
+	bool has(size_t n)
+	{
+		if (ok && size_t(end - pos) >= n)
+			return true;
+		ok = false;
+		return false;
+	}
+
+	uint8_t u8()
+	{
+		return has(1) ? *pos++ : 0;
+	}
+
+	uint32_t u32()
+	{
+		if (!has(4))
+			return 0;
+		uint32_t v = pos[0] | uint32_t(pos[1]) << 8 | uint32_t(pos[2]) << 16 | uint32_t(pos[3]) << 24;
+		pos += 4;
+		return v;
+	}
+
+	uint64_t u64()
+	{
+		uint64_t lo = u32();
+		return lo | uint64_t(u32()) << 32;
+	}
+
+	float f32()
+	{
+		uint32_t u = u32();
+		float v;
+		memcpy(&v, &u, 4);
+		return v;
+	}
+
+	uint64_t varint()
+	{
+		uint64_t v = 0;
+		for (int shift = 0; shift < 64 && has(1); shift += 7)
+		{
+			const uint8_t b = *pos++;
+			v |= uint64_t(b & 0x7f) << shift;
+			if (!(b & 0x80))
+				return v;
+		}
+		ok = false;
+		return 0;
+	}
+
+	float coord(bool quantized)
+	{
+		if (!quantized)
+			return f32();
+		if (!has(2))
+			return 0;
+		const int16_t q = int16_t(pos[0] | pos[1] << 8);
+		pos += 2;
+		return q / 256.0f;
+	}
+
+	void point(bool quantized, int &base_x, int &base_y, float &x, float &y)
+	{
+		if (!quantized)
+		{
+			x = f32();
+			y = f32();
+			return;
+		}
+		//wraps instead of overflowing on corrupt input
+		base_x = int(uint32_t(base_x) + uint32_t(unzigzag(varint())));
+		base_y = int(uint32_t(base_y) + uint32_t(unzigzag(varint())));
+		x = base_x / 256.0f;
+		y = base_y / 256.0f;
+	}
+
+	//n bytes in place
+	const uint8_t *bytes(uint64_t n)
+	{
+		if (n > uint64_t(end - pos) || !has(size_t(n)))
+		{
+			ok = false;
+			return 0;
+		}
+		const uint8_t *p = pos;
+		pos += n;
+		return p;
+	}
+
+	const uint8_t *pos;
+	const uint8_t *end;
+	bool ok;
+};
+
+void ResultStreamWriter::begin(uint32_t flags, size_t count, uint64_t ts, std::vector<uint8_t> &out)
+{
+	out.clear();
+	out.insert(out.end(), RESULT_STREAM_MAGIC, RESULT_STREAM_MAGIC + 4);
+	put_u32(out, RESULT_STREAM_VERSION);
+	put_u32(out, flags | (quantize ? RESULT_STREAM_QUANTIZED : 0));
+	put_u32(out, uint32_t(count));
+	//size, patched at the end
+	put_u32(out, 0);
+	put_u64(out, ts);
+}
+
+static void result_frame_finish(std::vector<uint8_t> &out)
+{
+	const uint32_t size = uint32_t(out.size());
+	for (int i = 0; i < 4; ++i)
+		out[16 + i] = uint8_t(size >> (8 * i));
+}
+
+void ResultStreamWriter::write_record(const ResultDetection &det, uint8_t flags, uint64_t frame_ts,
+	std::vector<uint8_t> &out)
+{
+	if (!det.label.empty())
+		flags |= RECORD_LABEL;
+	if (!det.fingerprint.empty())
+		flags |= RECORD_FINGERPRINT;
+
+	put_varint(out, zigzag(det.id));
+	put_varint(out, zigzag(det.type));
+	put_varint(out, zigzag(int64_t(det.ts - frame_ts)));
+	out.push_back(flags);
+	put_coord(out, det.center_x, quantize);
+	put_coord(out, det.center_y, quantize);
+	put_coord(out, det.width, quantize);
+	put_coord(out, det.height, quantize);
+	put_float(out, det.confidence);
+
+	if (flags & RECORD_LABEL)
+	{
+		put_varint(out, det.label.size());
+		out.insert(out.end(), det.label.begin(), det.label.end());
+	}
+	if (flags & RECORD_FINGERPRINT)
+	{
+		put_varint(out, det.fingerprint.size());
+		for (size_t i = 0; i < det.fingerprint.size(); ++i)
+			put_u64(out, det.fingerprint[i]);
+	}
+}
+
+void ResultStreamWriter::write(const std::vector<ResultDetection> &detections, uint64_t ts,
+	std::vector<uint8_t> &out)
+{
+	begin(0, detections.size(), ts, out);
+	for (size_t i = 0; i < detections.size(); ++i)
+		write_record(detections[i], 0, ts, out);
+	result_frame_finish(out);
+}
+
+void ResultStreamWriter::write(const std::vector<ResultTarget> &targets, uint64_t ts,
+	std::vector<uint8_t> &out)
+{
+	begin(RESULT_STREAM_TARGETS, targets.size(), ts, out);
+	for (size_t i = 0; i < targets.size(); ++i)
+	{
+		const ResultTarget &target = targets[i];
+		const ResultTrack::points_t &points = target.track.points;
+
+		//points after the last sent one; the whole track for a new object,
+		//an unnumbered or empty track or one that restarted (its oldest
+		//point is older than the one sent, see ResultTrack::unseen_from()),
+		//and when decimation dropped some of the new points, which the
+		//consumer could not repeat
+		size_t first = 0;
+		IdMap<SentTrack>::const_iterator it = sent.find(target.id);
+		if (delta && it != sent.end() && !points.empty() &&
+			points.front().seq >= it->second.front_seq)
+		{
+			first = target.track.unseen_from(it->second.back);
+			if (points.size() - first != points.back().seq - it->second.back.seq)
+				first = 0;
+		}
+		const bool track_delta = first > 0;
+
+		uint8_t flags = RECORD_TRACK;
+		if (target.ready)
+			flags |= RECORD_READY;
+		if (!target.icon.empty())
+			flags |= RECORD_ICON;
+		if (!target.shape.empty())
+			flags |= RECORD_SHAPE;
+		if (track_delta)
+			flags |= RECORD_TRACK_DELTA;
+		write_record(target, flags, ts, out);
+		put_float(out, target.speed_x);
+		put_float(out, target.speed_y);
+
+		if (flags & RECORD_ICON)
+		{
+			put_varint(out, target.icon_w);
+			put_varint(out, target.icon_h);
+			put_varint(out, target.icon.size());
+			out.insert(out.end(), target.icon.begin(), target.icon.end());
+		}
+
+		//point lists start from the (quantized) center
+		const int center_x = quantize_coord(target.center_x);
+		const int center_y = quantize_coord(target.center_y);
+		if (flags & RECORD_SHAPE)
+		{
+			block.clear();
+			int base_x = center_x;
+			int base_y = center_y;
+			for (size_t j = 0; j < target.shape.size(); ++j)
+				put_point(block, target.shape[j].x, target.shape[j].y, quantize, base_x, base_y);
+			put_varint(out, target.shape.size());
+			put_varint(out, block.size());
+			out.insert(out.end(), block.begin(), block.end());
+		}
+
+		//ts as gaps from the previous point (the target ts for the first)
+		block.clear();
+		int base_x = center_x;
+		int base_y = center_y;
+		uint64_t point_ts = target.ts;
+		for (size_t j = first; j < points.size(); ++j)
+		{
+			const ResultTrack::Point &pt = points[j];
+			put_point(block, pt.x, pt.y, quantize, base_x, base_y);
+			put_varint(block, zigzag(int64_t(pt.ts - point_ts)));
+			point_ts = pt.ts;
+		}
+		put_float(out, target.track.path_len);
+		put_varint(out, points.size() - first);
+		put_varint(out, block.size());
+		out.insert(out.end(), block.begin(), block.end());
+		if (!points.empty())
+		{
+			SentTrack &last = sent[target.id];
+			last.front_seq = points.front().seq;
+			last.back = points.back();
+		}
+		else
+		{
+			sent.erase(target.id);
+		}
+	}
+	result_frame_finish(out);
+
+	//forget objects that are gone
+	existing.clear();
+	for (size_t i = 0; i < targets.size(); ++i)
+		existing[targets[i].id] = true;
+	sent.erase_if([this](const IdMap<SentTrack>::value_type &obj) {
+		return !existing.count(obj.first);
+	});
+}
+
+size_t result_frame_size(const uint8_t *buffer, size_t size)
+{
+	if (size < RESULT_STREAM_HEADER || memcmp(buffer, RESULT_STREAM_MAGIC, 4))
+		return 0;
+	ResultCursor c(buffer + 16, buffer + size);
+	const uint32_t frame_size = c.u32();
+	return frame_size >= RESULT_STREAM_HEADER && frame_size <= size ? frame_size : 0;
+}
+
+bool ResultStreamReader::open(const uint8_t *buffer, size_t size)
+{
+	data = end = pos = 0;
+	count = left = 0;
+	const size_t frame_size = result_frame_size(buffer, size);
+	if (!frame_size)
+		return false;
+
+	ResultCursor c(buffer + 4, buffer + frame_size);
+	if (c.u32() != RESULT_STREAM_VERSION)
+		return false;
+	flags = c.u32();
+	count = c.u32();
+	c.u32();
+	ts = c.u64();
+
+	data = buffer;
+	end = buffer + frame_size;
+	pos = c.pos;
+	left = count;
+	return true;
+}
+
+bool ResultStreamReader::next(ResultRecordView &view)
+{
+	if (!left)
+		return false;
+
+	ResultCursor c(pos, end);
+	const bool quantized = (flags & RESULT_STREAM_QUANTIZED) != 0;
+	view.quantized = quantized;
+	view.id = int(unzigzag(c.varint()));
+	view.type = int(unzigzag(c.varint()));
+	view.ts = ts + uint64_t(unzigzag(c.varint()));
+	const uint8_t record = c.u8();
+	view.center_x = c.coord(quantized);
+	view.center_y = c.coord(quantized);
+	view.width = c.coord(quantized);
+	view.height = c.coord(quantized);
+	view.confidence = c.f32();
+
+	view.label = 0;
+	view.label_size = 0;
+	if (record & RECORD_LABEL)
+	{
+		view.label_size = size_t(c.varint());
+		view.label = (const char *)c.bytes(view.label_size);
+	}
+	view.fingerprint = 0;
+	view.fingerprint_count = 0;
+	if (record & RECORD_FINGERPRINT)
+	{
+		const uint64_t n = c.varint();
+		view.fingerprint = n < (uint64_t(1) << 60) ? c.bytes(8 * n) : 0;
+		view.fingerprint_count = view.fingerprint ? size_t(n) : 0;
+	}
+
+	view.ready = (record & RECORD_READY) != 0;
+	view.speed_x = view.speed_y = 0;
+	view.icon = 0;
+	view.icon_size = 0;
+	view.icon_w = view.icon_h = 0;
+	view.shape = view.track = 0;
+	view.shape_count = view.shape_size = 0;
+	view.track_count = view.track_size = 0;
+	view.track_delta = false;
+	view.path_len = 0;
+	if (flags & RESULT_STREAM_TARGETS)
+	{
+		view.speed_x = c.f32();
+		view.speed_y = c.f32();
+		if (record & RECORD_ICON)
+		{
+			view.icon_w = int(c.varint());
+			view.icon_h = int(c.varint());
+			view.icon_size = size_t(c.varint());
+			view.icon = c.bytes(view.icon_size);
+		}
+		if (record & RECORD_SHAPE)
+		{
+			view.shape_count = size_t(c.varint());
+			view.shape_size = size_t(c.varint());
+			view.shape = c.bytes(view.shape_size);
+			//a point takes at least two varints or two floats
+			if (view.shape_count > view.shape_size / (quantized ? 2 : 8))
+				c.ok = false;
+		}
+		if (record & RECORD_TRACK)
+		{
+			view.track_delta = (record & RECORD_TRACK_DELTA) != 0;
+			view.path_len = c.f32();
+			view.track_count = size_t(c.varint());
+			view.track_size = size_t(c.varint());
+			view.track = c.bytes(view.track_size);
+			if (view.track_count > view.track_size / (quantized ? 3 : 9))
+				c.ok = false;
+		}
+	}
+
+	if (!c.ok)
+	{
+		left = 0;
+		return false;
+	}
+	pos = c.pos;
+	--left;
+	return true;
+}
+
+bool decode_result(const ResultRecordView &view, ResultDetection &det)
+{
+	det.id = view.id;
+	det.type = view.type;
+	det.ts = view.ts;
+	det.center_x = view.center_x;
+	det.center_y = view.center_y;
+	det.width = view.width;
+	det.height = view.height;
+	det.confidence = view.confidence;
+	if (view.label_size)
+		det.label.assign(view.label, view.label_size);
+	else
+		det.label.clear();
+	det.fingerprint.resize(view.fingerprint_count);
+	ResultCursor c(view.fingerprint, view.fingerprint + 8 * view.fingerprint_count);
+	for (size_t i = 0; i < view.fingerprint_count; ++i)
+		det.fingerprint[i] = c.u64();
+	return true;
+}
+
+bool decode_result(const ResultRecordView &view, ResultTarget &target)
+{
+	decode_result(view, static_cast<ResultDetection &>(target));
+	target.ready = view.ready;
+	target.speed_x = view.speed_x;
+	target.speed_y = view.speed_y;
+	target.icon_w = view.icon_w;
+	target.icon_h = view.icon_h;
+	target.icon.assign(view.icon, view.icon + view.icon_size);
+	return decode_shape(view, target.shape) && decode_track(view, target.track);
+}
+
+bool decode_shape(const ResultRecordView &view, std::vector<cv::Point2f> &shape)
+{
+	shape.resize(view.shape_count);
+	ResultCursor c(view.shape, view.shape + view.shape_size);
+	int base_x = quantize_coord(view.center_x);
+	int base_y = quantize_coord(view.center_y);
+	for (size_t i = 0; i < view.shape_count && c.ok; ++i)
+		c.point(view.quantized, base_x, base_y, shape[i].x, shape[i].y);
+	if (!c.ok)
+		shape.clear();
+	return c.ok;
+}
+
+bool decode_track(const ResultRecordView &view, ResultTrack &track)
+{
+	if (!view.track_delta)
+		track.clear();
+	ResultCursor c(view.track, view.track + view.track_size);
+	int base_x = quantize_coord(view.center_x);
+	int base_y = quantize_coord(view.center_y);
+	uint64_t ts = view.ts;
+	for (size_t i = 0; i < view.track_count && c.ok; ++i)
+	{
+		float x, y;
+		c.point(view.quantized, base_x, base_y, x, y);
+		ts += uint64_t(unzigzag(c.varint()));
+		if (c.ok)
+			track.push_back(ResultTrack::Point(x, y, ts));
+	}
+	track.path_len = view.path_len;
+	return c.ok;
+}
+
+}  // namespace anfisa
@@ -0,0 +1,137 @@
+#ifndef ANFISA_SERIALIZATION_H
+#define ANFISA_SERIALIZATION_H
+
+#include "id-map.hpp"
+#include "io-structures.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace anfisa {
+
+enum RESULT_STREAM_FLAGS
+{
+	//records are ResultTarget (speed, icon, shape, track), else ResultDetection
+	RESULT_STREAM_TARGETS = 0x1,
+	//percent coordinates as int16 in 1/256 units, point lists delta coded
+	RESULT_STREAM_QUANTIZED = 0x2
+};
+
+// Binary frame of results: a fixed header (magic, version, flags, record
+// count, byte size, frame ts) and one record per object. Integers are
+// little endian varints, floats are 32-bit little endian, so the format
+// does not depend on the host. Shape and track blocks are length prefixed
+// and read on demand.
+// Track records are full or delta: the writer remembers per object the
+// track it sent and, with delta on, sends only the points after it; a
+// consumer appending them with ResultTrack::push_back() (same capacity
+// and decimation as the producer) keeps the same track. Tracks whose points
+// are not numbered by push_back() always go full, as does a new track
+// under an id that was sent before.
+class ResultStreamWriter
+{
+public:
+	explicit ResultStreamWriter(bool quantize = false, bool delta = true)
+		: quantize(quantize), delta(delta) {}
+
+	//out gets one frame
+	void write(const std::vector<ResultTarget> &targets, uint64_t ts, std::vector<uint8_t> &out);
+	void write(const std::vector<ResultDetection> &detections, uint64_t ts,
+		std::vector<uint8_t> &out);
+	//next frame sends full tracks, e.g. for a new consumer
+	void reset() { sent.clear(); }
+
+	bool quantize;
+	bool delta;
+
+private:
+	void begin(uint32_t flags, size_t count, uint64_t ts, std::vector<uint8_t> &out);
+	void write_record(const ResultDetection &det, uint8_t flags, uint64_t frame_ts,
+		std::vector<uint8_t> &out);
+
+	struct SentTrack
+	{
+		SentTrack() : front_seq(0) {}
+		//seq of the oldest and the newest point of the track sent last
+		uint32_t front_seq;
+		ResultTrack::Point back;
+	};
+
+	//object_id -> track sent last
+	IdMap<SentTrack> sent;
+	DetectorZoneState::obj_t existing;
+	std::vector<uint8_t> block;
+};
+
+// One record, pointing into the frame buffer.
+struct ResultRecordView
+{
+	int id;
+	int type;
+	uint64_t ts;
+	float center_x;
+	float center_y;
+	float width;
+	float height;
+	float confidence;
+
+	bool ready;
+	float speed_x;
+	float speed_y;
+
+	const char *label;
+	size_t label_size;
+	//fingerprint_count little endian uint64
+	const uint8_t *fingerprint;
+	size_t fingerprint_count;
+	int icon_w;
+	int icon_h;
+	const uint8_t *icon;
+	size_t icon_size;
+
+	bool quantized;
+	size_t shape_count;
+	const uint8_t *shape;
+	size_t shape_size;
+	bool track_delta;
+	float path_len;
+	size_t track_count;
+	const uint8_t *track;
+	size_t track_size;
+};
+
+// Reader over a frame in memory, the buffer must outlive the views.
+class ResultStreamReader
+{
+public:
+	ResultStreamReader() : data(0), end(0), pos(0), flags(0), count(0), left(0), ts(0) {}
+
+	//false if the buffer does not start with a supported frame
+	bool open(const uint8_t *buffer, size_t size);
+	//false after the last record or on a malformed one
+	bool next(ResultRecordView &view);
+
+	const uint8_t *data;
+	const uint8_t *end;
+	const uint8_t *pos;
+	uint32_t flags;
+	uint32_t count;
+	uint32_t left;
+	uint64_t ts;
+};
+
+//bytes used by the frame at the start of buffer, 0 if there is none
+size_t result_frame_size(const uint8_t *buffer, size_t size);
+
+//copy the fields of a view; false on a malformed shape or track block
+bool decode_result(const ResultRecordView &view, ResultDetection &det);
+//track points of a delta record are appended to target.track, pass the
+//target of the same id from the previous frame
+bool decode_result(const ResultRecordView &view, ResultTarget &target);
+bool decode_shape(const ResultRecordView &view, std::vector<cv::Point2f> &shape);
+bool decode_track(const ResultRecordView &view, ResultTrack &track);
+
+}  // namespace anfisa
+
+#endif  // ANFISA_SERIALIZATION_H
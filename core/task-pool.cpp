@@ -0,0 +1,123 @@
+#include "task-pool.hpp"
+
+#include <algorithm>
+
+namespace anfisa {
+
+TaskPool::TaskPool(int count)
+	: queued(0), pending(0), next_queue(0), stop(false)
+{
+	if (count <= 0)
+		count = std::max(1, (int)std::thread::hardware_concurrency());
+
+	for (int i = 0; i < count; ++i)
+		queues.push_back(std::unique_ptr<Queue>(new Queue));
+	for (int i = 1; i < count; ++i)
+		threads.push_back(std::thread(&TaskPool::loop, this, i));
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(state_lock);
+		stop = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
+
+void TaskPool::push(const task_t &task)
+{
+	//counted before the task is visible: a worker finishing it must not
+	//see pending drop to 0 while other tasks are still running
+	{
+		std::lock_guard<std::mutex> guard(state_lock);
+		++pending;
+		++queued;
+	}
+	Queue &q = *queues[next_queue++ % queues.size()];
+	{
+		std::lock_guard<std::mutex> guard(q.lock);
+		q.tasks.push_back(task);
+	}
+	wake.notify_one();
+}
+
+bool TaskPool::pop(int index, task_t &task)
+{
+	const int count = size();
+	for (int k = 0; k < count; ++k)
+	{
+		Queue &q = *queues[(index + k) % count];
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (q.tasks.empty())
+			continue;
+
+		//own tasks are taken LIFO (hot in cache), stolen ones FIFO
+		if (!k)
+		{
+			task.swap(q.tasks.back());
+			q.tasks.pop_back();
+		}
+		else
+		{
+			task.swap(q.tasks.front());
+			q.tasks.pop_front();
+		}
+		--queued;
+		return true;
+	}
+	return false;
+}
+
+void TaskPool::finish()
+{
+	if (--pending == 0)
+	{
+		std::lock_guard<std::mutex> guard(state_lock);
+		done.notify_all();
+	}
+}
+
+void TaskPool::loop(int index)
+{
+	task_t task;
+	while (true)
+	{
+		if (pop(index, task))
+		{
+			task(index);
+			task = task_t();
+			finish();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(state_lock);
+		wake.wait(guard, [this] { return stop || queued > 0; });
+		if (stop)
+			return;
+	}
+}
+
+void TaskPool::wait()
+{
+	task_t task;
+	while (true)
+	{
+		if (pop(0, task))
+		{
+			task(0);
+			task = task_t();
+			finish();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(state_lock);
+		done.wait(guard, [this] { return pending == 0 || queued > 0; });
+		if (pending == 0)
+			return;
+	}
+}
+
+}  // namespace anfisa
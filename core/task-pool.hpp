@@ -0,0 +1,66 @@
+#ifndef ANFISA_TASK_POOL_H
+#define ANFISA_TASK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace anfisa {
+
+// Work-stealing thread pool.
+// Every thread owns a task deque: it takes its own tasks from the back and
+// steals from the front of other deques when its own is empty.
+// Thread 0 is the caller of wait(), so a pool of size 1 runs everything
+// in the calling thread. Tasks get the index of the thread running them
+// (0 .. size() - 1) to address per-thread buffers.
+class TaskPool
+{
+public:
+	typedef std::function<void(int thread_index)> task_t;
+
+	//0 - use all hardware threads
+	explicit TaskPool(int threads = 0);
+	~TaskPool();
+
+	int size() const { return (int)queues.size(); }
+
+	void push(const task_t &task);
+	//run tasks in the calling thread until all pushed tasks are finished
+	void wait();
+
+private:
+	TaskPool(const TaskPool &);
+	TaskPool &operator=(const TaskPool &);
+
+	struct Queue
+	{
+		std::mutex lock;
+		std::deque<task_t> tasks;
+	};
+
+	bool pop(int index, task_t &task);
+	void finish();
+	void loop(int index);
+
+	std::vector<std::unique_ptr<Queue> > queues;
+	std::vector<std::thread> threads;
+
+	std::mutex state_lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+	//pushed but not taken yet
+	std::atomic<int> queued;
+	//pushed but not finished yet
+	std::atomic<int> pending;
+	std::atomic<unsigned> next_queue;
+	bool stop;
+};
+
+}  // namespace anfisa
+
+#endif  // ANFISA_TASK_POOL_H
@@ -0,0 +1,230 @@
+#include "zone-set.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace anfisa {
+
+void ZoneSet::set_zones(const std::vector<DetectorZoneParams> &zone_params)
+{
+	params = zone_params;
+	const int n = (int)params.size();
+	states.assign(n, DetectorZoneState());
+	boxes.assign(4 * n, 0);
+	stamp.assign(n, 0);
+	stamp_now = 0;
+
+	float left = FLT_MAX;
+	float top = FLT_MAX;
+	float right = -FLT_MAX;
+	float bottom = -FLT_MAX;
+	double size = 0;
+	int boxed = 0;
+	for (int z = 0; z < n; ++z)
+	{
+		DetectorZoneParams &zone = params[z];
+		zone.compile();
+		const std::vector<double> &pts = zone.points;
+		if (pts.size() < 2)
+			continue;
+
+		//check_borders() uses float points, is_inside() truncated ones;
+		//with an odd count the last edge mixes x and y values
+		float *box = &boxes[4 * z];
+		box[0] = box[1] = FLT_MAX;
+		box[2] = box[3] = -FLT_MAX;
+		for (size_t j = 0; j < pts.size(); ++j)
+		{
+			const bool any_axis = pts.size() % 2 != 0;
+			const float v = float(pts[j]);
+			const float t = float(int(pts[j]));
+			for (int axis = 0; axis < 2; ++axis)
+			{
+				if (!any_axis && int(j % 2) != axis)
+					continue;
+				box[axis] = std::min(box[axis], std::min(v, t));
+				box[axis + 2] = std::max(box[axis + 2], std::max(v, t));
+			}
+		}
+
+		left = std::min(left, box[0]);
+		top = std::min(top, box[1]);
+		right = std::max(right, box[2]);
+		bottom = std::max(bottom, box[3]);
+		size += std::max(box[2] - box[0], box[3] - box[1]);
+		++boxed;
+	}
+
+	if (!boxed)
+	{
+		grid.reset(0, 0, 0, 0, 1);
+		return;
+	}
+	grid.reset(left, top, right, bottom, float(size / boxed));
+	for (int z = 0; z < n; ++z)
+	{
+		if (params[z].points.size() < 2)
+			continue;
+		const float *box = &boxes[4 * z];
+		grid.insert(z, box[0], box[1], box[2], box[3]);
+	}
+}
+
+void ZoneSet::collect(float left, float top, float right, float bottom)
+{
+	candidates.clear();
+	if (grid.items.empty())
+		return;
+	if (++stamp_now == 0)
+	{
+		std::fill(stamp.begin(), stamp.end(), 0);
+		stamp_now = 1;
+	}
+
+	int c0, r0, c1, r1;
+	grid.cells(left, top, right, bottom, c0, r0, c1, r1);
+	for (int r = r0; r <= r1; ++r)
+	{
+		for (int c = c0; c <= c1; ++c)
+		{
+			for (int e = grid.head[r * grid.cols + c]; e >= 0; e = grid.next[e])
+			{
+				const int z = grid.items[e];
+				if (stamp[z] == stamp_now)
+					continue;
+				stamp[z] = stamp_now;
+				const float *box = &boxes[4 * z];
+				if (box[0] <= right && left <= box[2] && box[1] <= bottom && top <= box[3])
+					candidates.push_back(z);
+			}
+		}
+	}
+}
+
+void ZoneSet::check_segments(const ResultTarget &object)
+{
+	float left = FLT_MAX;
+	float top = FLT_MAX;
+	float right = -FLT_MAX;
+	float bottom = -FLT_MAX;
+	for (size_t i = 0; i < segments.size(); i += 4)
+	{
+		left = std::min(left, std::min(segments[i], segments[i + 2]));
+		right = std::max(right, std::max(segments[i], segments[i + 2]));
+		top = std::min(top, std::min(segments[i + 1], segments[i + 3]));
+		bottom = std::max(bottom, std::max(segments[i + 1], segments[i + 3]));
+	}
+
+	const int count = int(segments.size() / 4);
+	directions.resize(count);
+	collect(left, top, right, bottom);
+	for (size_t i = 0; i < candidates.size(); ++i)
+	{
+		const int z = candidates[i];
+		const DetectorZoneParams &zone = params[z];
+		if (zone.borders.cross(&segments[0], count, &directions[0]) < 0)
+			continue;
+
+		DetectorZoneState &state = states[z];
+		const bool is_border = zone.borders.type == ZONE_TYPE_BORDER ||
+			zone.borders.type == ZONE_TYPE_BORDER_SWAPPED;
+		const bool inside = !is_border && zone.is_inside(object.center_x, object.center_y, true);
+		for (int k = 0; k < count; ++k)
+		{
+			const int cross = directions[k];
+			if (!cross)
+				continue;
+
+			if (is_border)
+			{
+				if (cross > 0)
+					state.cross_AB[object.id] = true;
+				else
+					state.cross_BA[object.id] = true;
+				state.limits_update(object);
+			}
+			else
+			{
+				if (inside)
+					state.enters[object.id] = true;
+				else
+					state.leavings[object.id] = true;
+			}
+		}
+	}
+}
+
+void ZoneSet::update(const std::vector<ResultTarget> &objects)
+{
+	for (size_t z = 0; z < states.size(); ++z)
+		states[z].reset();
+
+	for (size_t tg_ind = 0; tg_ind < objects.size(); ++tg_ind)
+	{
+		const ResultTarget &object = objects[tg_ind];
+		const float cx = object.center_x;
+		const float cy = object.center_y;
+		if (std::isfinite(cx) && std::isfinite(cy))
+		{
+			collect(cx, cy, cx, cy);
+			for (size_t i = 0; i < candidates.size(); ++i)
+			{
+				const int z = candidates[i];
+				if (params[z].is_inside(cx, cy, true))
+				{
+					states[z].objects_in_zone[object.id] = true;
+					states[z].limits_update(object);
+				}
+			}
+		}
+
+		const ResultTrack::points_t &points = object.track.points;
+		if (points.size() < 2)
+			continue;
+		ResultTrack::Point &watermark = watermarks[object.id];
+		const size_t first = std::max<size_t>(object.track.unseen_from(watermark), 1);
+		watermark = points.back();
+
+		//segments ending at a point after the watermark, newest first;
+		//NaN or infinite points cannot cross and are left out
+		segments.clear();
+		for (size_t i = points.size() - 1; i >= first; --i)
+		{
+			const ResultTrack::Point &prev_pt = points[i];
+			const ResultTrack::Point &cur_pt = points[i - 1];
+			if (std::isfinite(prev_pt.x) && std::isfinite(prev_pt.y) &&
+				std::isfinite(cur_pt.x) && std::isfinite(cur_pt.y))
+			{
+				segments.push_back(prev_pt.x);
+				segments.push_back(prev_pt.y);
+				segments.push_back(cur_pt.x);
+				segments.push_back(cur_pt.y);
+			}
+		}
+		if (!segments.empty())
+			check_segments(object);
+	}
+
+	//remove lost objects
+	existing.clear();
+	for (size_t i = 0; i < objects.size(); ++i)
+		existing[objects[i].id] = true;
+	for (size_t z = 0; z < states.size(); ++z)
+	{
+		DetectorZoneState &state = states[z];
+		if (!state.cross_AB.empty())
+			state.container_sanitize(state.cross_AB, existing);
+		if (!state.cross_BA.empty())
+			state.container_sanitize(state.cross_BA, existing);
+		if (!state.enters.empty())
+			state.container_sanitize(state.enters, existing);
+		if (!state.leavings.empty())
+			state.container_sanitize(state.leavings, existing);
+	}
+	watermarks.erase_if([this](const IdMap<ResultTrack::Point>::value_type &obj) {
+		return !existing.count(obj.first);
+	});
+}
+
+}  // namespace anfisa
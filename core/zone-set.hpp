@@ -0,0 +1,60 @@
+#ifndef ANFISA_ZONE_SET_H
+#define ANFISA_ZONE_SET_H
+
+#include "grouping.hpp"
+#include "io-structures.hpp"
+
+#include <vector>
+
+namespace anfisa {
+
+// All detector zones of a camera evaluated in one pass over the targets.
+// Zone bounding boxes are kept in a BoxGrid: an object center is tested
+// only against zones of its cell, the new track segments of an object
+// go in one batch to DetectorZoneBorders::cross() of the zones their box
+// overlaps, so the cost grows with objects x nearby zones.
+// All zones are updated together, so one watermark per object stands for
+// the per zone ones of DetectorZoneState. Every zone gets the outputs of
+// DetectorZoneState::update() in states[i], except that degenerate
+// crossings far away from the zone (exactly collinear lines) are not
+// reported.
+class ZoneSet
+{
+public:
+	ZoneSet() : stamp_now(0) {}
+
+	//copy and compile zones, states are reset
+	void set_zones(const std::vector<DetectorZoneParams> &zone_params);
+	void update(const std::vector<ResultTarget> &objects);
+
+	const std::vector<DetectorZoneParams> &zones() const { return params; }
+
+	//per zone results, same order as zones()
+	std::vector<DetectorZoneState> states;
+
+private:
+	//zones with boxes overlapping the query box into candidates
+	void collect(float left, float top, float right, float bottom);
+	//new track segments of object against the zones they may cross
+	void check_segments(const ResultTarget &object);
+
+	//compiled by set_zones() and not changed until the next call, so the
+	//index and borders are used without DetectorZoneParams::compiled()
+	std::vector<DetectorZoneParams> params;
+	//zone boxes, 4 values per zone (left top right bottom), empty zones are not in the grid
+	std::vector<float> boxes;
+	BoxGrid grid;
+
+	std::vector<int> candidates;
+	std::vector<float> segments;
+	std::vector<int> directions;
+	std::vector<unsigned> stamp;
+	unsigned stamp_now;
+	DetectorZoneState::obj_t existing;
+	//object_id -> newest track point tested
+	IdMap<ResultTrack::Point> watermarks;
+};
+
+}  // namespace anfisa
+
+#endif  // ANFISA_ZONE_SET_H
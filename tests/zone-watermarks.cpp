@@ -0,0 +1,279 @@
+// Zone events of replayed tracks: DetectorZoneState::update() and
+// ZoneSet::update() test only the segments after their watermarks, the
+// reference rescans every segment of every track each frame and counts a
+// segment once by (object id, track, seq of its newer point). Tracks are
+// numbered (push_back() only, with and without eviction, decimated with the
+// ring buffer wrapping) or unnumbered, ids are reused for new tracks.
+// Exits with 1 if any frame of any zone differs.
+
+#include "core/io-structures.hpp"
+#include "core/zone-set.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace anfisa;
+
+enum
+{
+	ZONES = 12,
+	FRAMES = 800,
+	MAX_OBJECTS = 40
+};
+
+enum ReplayMode
+{
+	REPLAY_NUMBERED,
+	REPLAY_EVICTED,
+	REPLAY_DECIMATED,
+	REPLAY_UNNUMBERED,
+	REPLAY_MODES
+};
+
+static const char *mode_names[REPLAY_MODES] = {"numbered", "evicted", "decimated", "unnumbered"};
+
+//segment of a track, by its newer point
+struct SegmentKey
+{
+	int id;
+	int track;
+	uint32_t seq;
+
+	bool operator<(const SegmentKey &other) const
+	{
+		if (id != other.id)
+			return id < other.id;
+		if (track != other.track)
+			return track < other.track;
+		return seq < other.seq;
+	}
+};
+
+static float uniform(float from, float to)
+{
+	return from + (to - from) * float(rand() % 100000) / 100000.0f;
+}
+
+static std::vector<DetectorZoneParams> make_zones()
+{
+	static const char *types[] = {"lookup", "border", "border_swapped", "ignore"};
+	std::vector<DetectorZoneParams> zones(ZONES);
+	for (int z = 0; z < ZONES; ++z)
+	{
+		DetectorZoneParams &zone = zones[z];
+		zone.type = types[z % 4];
+		const bool is_border = z % 4 == 1 || z % 4 == 2;
+		const int count = is_border ? 2 + rand() % 3 : 3 + rand() % 6;
+		const float cx = uniform(100, 400);
+		const float cy = uniform(100, 400);
+		const float r = uniform(30, 120);
+		for (int i = 0; i < count; ++i)
+		{
+			zone.points.push_back(cx + uniform(-r, r));
+			zone.points.push_back(cy + uniform(-r, r));
+		}
+		zone.compile();
+	}
+	return zones;
+}
+
+static ResultTarget make_target(int id, ReplayMode mode)
+{
+	ResultTarget target;
+	target.id = id;
+	target.center_x = uniform(0, 500);
+	target.center_y = uniform(0, 500);
+	target.width = uniform(10, 50);
+	target.height = uniform(10, 80);
+	target.speed_x = uniform(-5, 5);
+	target.speed_y = uniform(-5, 5);
+	target.track.decimate = mode == REPLAY_DECIMATED;
+	target.track.set_capacity(mode == REPLAY_EVICTED ? 8 : mode == REPLAY_DECIMATED ? 16 : 200);
+	return target;
+}
+
+static void move_target(ResultTarget &target, ReplayMode mode, int frame)
+{
+	target.center_x += uniform(-12, 12);
+	target.center_y += uniform(-12, 12);
+	const int count = rand() % 10 ? 1 : 1 + rand() % 4;
+	for (int i = 0; i < count; ++i)
+	{
+		ResultTrack::Point pt(target.center_x + uniform(-2, 2), target.center_y + uniform(-2, 2),
+			frame);
+		if (mode == REPLAY_UNNUMBERED)
+			target.track.points.push_back(pt);
+		else
+			target.track.push_back(pt);
+	}
+}
+
+//segments of the frame never tested before, every one if not numbered
+static void new_segments(const ResultTarget &target, int track, std::set<SegmentKey> &tested,
+	std::vector<size_t> &segments)
+{
+	segments.clear();
+	const ResultTrack::points_t &points = target.track.points;
+	for (size_t i = 1; i < points.size(); ++i)
+	{
+		if (points[i].seq)
+		{
+			const SegmentKey key = {target.id, track, points[i].seq};
+			if (!tested.insert(key).second)
+				continue;
+		}
+		segments.push_back(i);
+	}
+}
+
+static void rescan(DetectorZoneState &state, const DetectorZoneParams &zone,
+	const ResultTarget &target, const std::vector<size_t> &segments)
+{
+	const bool is_border = zone.type == "border" || zone.type == "border_swapped";
+	const bool inside = zone.is_inside(target.center_x, target.center_y);
+	if (inside)
+	{
+		state.objects_in_zone[target.id] = true;
+		state.limits_update(target);
+	}
+
+	const ResultTrack::points_t &points = target.track.points;
+	for (size_t k = 0; k < segments.size(); ++k)
+	{
+		const ResultTrack::Point &prev_pt = points[segments[k]];
+		const ResultTrack::Point &cur_pt = points[segments[k] - 1];
+		const int cross = zone.check_borders(prev_pt.x, prev_pt.y, cur_pt.x, cur_pt.y);
+		if (!cross)
+			continue;
+		if (is_border)
+		{
+			if (cross > 0)
+				state.cross_AB[target.id] = true;
+			else
+				state.cross_BA[target.id] = true;
+			state.limits_update(target);
+		}
+		else if (inside)
+			state.enters[target.id] = true;
+		else
+			state.leavings[target.id] = true;
+	}
+}
+
+static std::map<int, bool> sorted(const DetectorZoneState::obj_t &ids)
+{
+	std::map<int, bool> res;
+	for (DetectorZoneState::obj_t::const_iterator it = ids.begin(); it != ids.end(); ++it)
+		res[it->first] = it->second;
+	return res;
+}
+
+static bool same_state(const DetectorZoneState &a, const DetectorZoneState &b)
+{
+	return sorted(a.cross_AB) == sorted(b.cross_AB) &&
+		sorted(a.cross_BA) == sorted(b.cross_BA) &&
+		sorted(a.enters) == sorted(b.enters) &&
+		sorted(a.leavings) == sorted(b.leavings) &&
+		sorted(a.objects_in_zone) == sorted(b.objects_in_zone) &&
+		a.size_w == b.size_w && a.size_h == b.size_h && a.size_max == b.size_max &&
+		a.speed_x == b.speed_x && a.speed_y == b.speed_y && a.speed_max == b.speed_max &&
+		a.track_len == b.track_len;
+}
+
+static int replay(ReplayMode mode, const std::vector<DetectorZoneParams> &zones)
+{
+	std::vector<DetectorZoneState> states(ZONES);
+	std::vector<DetectorZoneState> reference(ZONES);
+	ZoneSet zone_set;
+	zone_set.set_zones(zones);
+
+	std::vector<ResultTarget> targets;
+	//object id -> track number under this id
+	std::map<int, int> tracks;
+	std::set<SegmentKey> tested;
+	std::vector<size_t> segments;
+	DetectorZoneState::obj_t existing;
+	int next_id = 1;
+	int reused = 0;
+	int events = 0;
+	int mismatches = 0;
+
+	for (int frame = 0; frame < FRAMES; ++frame)
+	{
+		if ((int)targets.size() < MAX_OBJECTS && rand() % 3 == 0)
+		{
+			++tracks[next_id];
+			targets.push_back(make_target(next_id++, mode));
+		}
+		if (!targets.empty() && rand() % 25 == 0)
+			targets.erase(targets.begin() + rand() % targets.size());
+		//same id, new track
+		if (!targets.empty() && rand() % 15 == 0)
+		{
+			ResultTarget &target = targets[rand() % targets.size()];
+			++tracks[target.id];
+			target = make_target(target.id, mode);
+			++reused;
+		}
+		for (size_t i = 0; i < targets.size(); ++i)
+			if (rand() % 4)
+				move_target(targets[i], mode, frame);
+
+		for (int z = 0; z < ZONES; ++z)
+		{
+			states[z].update(targets, zones[z]);
+			reference[z].reset();
+		}
+		zone_set.update(targets);
+
+		existing.clear();
+		for (size_t i = 0; i < targets.size(); ++i)
+		{
+			const ResultTarget &target = targets[i];
+			existing[target.id] = true;
+			new_segments(target, tracks[target.id], tested, segments);
+			for (int z = 0; z < ZONES; ++z)
+				rescan(reference[z], zones[z], target, segments);
+		}
+		for (int z = 0; z < ZONES; ++z)
+		{
+			DetectorZoneState &ref = reference[z];
+			ref.container_sanitize(ref.cross_AB, existing);
+			ref.container_sanitize(ref.cross_BA, existing);
+			ref.container_sanitize(ref.enters, existing);
+			ref.container_sanitize(ref.leavings, existing);
+			events += int(ref.cross_AB.size() + ref.cross_BA.size() +
+				ref.enters.size() + ref.leavings.size());
+
+			if (!same_state(states[z], ref))
+			{
+				printf("%s: frame %d zone %d, DetectorZoneState differs from the rescan\n",
+					mode_names[mode], frame, z);
+				++mismatches;
+			}
+			if (!same_state(zone_set.states[z], ref))
+			{
+				printf("%s: frame %d zone %d, ZoneSet differs from the rescan\n",
+					mode_names[mode], frame, z);
+				++mismatches;
+			}
+		}
+	}
+
+	printf("%s: %d frames, %d reused ids, %d events, %d mismatches\n",
+		mode_names[mode], FRAMES, reused, events, mismatches);
+	return mismatches;
+}
+
+int main()
+{
+	srand(11);
+	const std::vector<DetectorZoneParams> zones = make_zones();
+	int mismatches = 0;
+	for (int mode = 0; mode < REPLAY_MODES; ++mode)
+		mismatches += replay(ReplayMode(mode), zones);
+	return mismatches ? 1 : 0;
+}